@@ -0,0 +1,578 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+#if defined(WIN32) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <fstream>
+#else
+#include <sys/resource.h>
+#endif
+
+// Every allocation in the process goes through these, so the benchmarks can report how many allocations a patcher makes
+static std::atomic<std::uint64_t> allocationCount = 0;
+static std::atomic<std::uint64_t> allocatedBytes = 0;
+
+void* operator new(std::size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { std::free(pointer); }
+
+namespace {
+    using Hips::u8;
+    using Hips::usize;
+    using Bytes = std::vector<u8>;
+
+    // Resets the peak resident set size, where the OS allows it, so each benchmark reports its own peak instead of the
+    // largest one so far
+    void resetPeakMemory() {
+#if defined(__linux__)
+        std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    std::uint64_t peakMemory() {
+#if defined(WIN32) || defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PeakWorkingSetSize : 0;
+#elif defined(__linux__)
+        std::ifstream status("/proc/self/status");
+        std::string line;
+
+        while (std::getline(status, line)) {
+            if (line.rfind("VmHWM:", 0) == 0) {
+                return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+            }
+        }
+
+        return 0;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return std::uint64_t(usage.ru_maxrss);  // In bytes on macOS
+#endif
+    }
+
+    // Small PRNG (splitmix64) so the inputs and patches are the same on every machine and every run
+    class Random {
+        std::uint64_t state;
+
+      public:
+        explicit Random(std::uint64_t seed) : state(seed) {}
+
+        std::uint64_t next() {
+            std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+
+        // Random number in [low, high]
+        usize range(usize low, usize high) { return low + usize(next() % (high - low + 1)); }
+
+        void fill(u8* data, usize size) {
+            usize i = 0;
+            for (; i + 8 <= size; i += 8) {
+                const std::uint64_t value = next();
+                std::memcpy(data + i, &value, 8);
+            }
+
+            for (; i < size; i++) {
+                data[i] = u8(next());
+            }
+        }
+    };
+
+    Bytes makeInput(usize size, std::uint64_t seed) {
+        Bytes data(size);
+        Random(seed).fill(data.data(), size);
+        return data;
+    }
+
+    void writeBE(Bytes& out, usize value, usize size) {
+        for (usize i = size; i > 0; i--) {
+            out.push_back(u8(value >> ((i - 1) * 8)));
+        }
+    }
+
+    // A patch along with the input it applies to. "operations" is how many records, hunks or actions it has
+    struct Case {
+        Bytes input;
+        Bytes patch;
+        usize outputSize = 0;
+        usize operations = 0;
+    };
+
+    // IPS can only address the first 16 MiB of a file, so records only go that far and the rest of the input is copied
+    constexpr usize ipsLimit = 0xFFFFFF;
+
+    // The patched file is as large as the records go, unless there's a footer with its size after EOF, which only fits for
+    // files up to 16 MiB
+    void finishIPS(Case& result, usize size, usize recordsEnd) {
+        result.patch.insert(result.patch.end(), {'E', 'O', 'F'});
+        if (size <= ipsLimit) {
+            writeBE(result.patch, size, 3);
+            result.outputSize = size;
+        } else {
+            result.outputSize = recordsEnd;
+        }
+    }
+
+    // Short literal records with gaps between them, like a translation patch
+    Case ipsSmallRecords(usize size) {
+        Case result{makeInput(size, 1), {'P', 'A', 'T', 'C', 'H'}};
+        Random random(2);
+        usize offset = random.range(0, 64);
+        usize end = 0;
+
+        while (true) {
+            const usize length = random.range(1, 32);
+            if (offset + length > std::min(size, ipsLimit)) {
+                break;
+            }
+
+            // A record at this offset would read as the end of the patch
+            if (offset != Hips::IPS::endOfFile) {
+                writeBE(result.patch, offset, 3);
+                writeBE(result.patch, length, 2);
+                const usize start = result.patch.size();
+                result.patch.resize(start + length);
+                random.fill(result.patch.data() + start, length);
+                result.operations++;
+                end = offset + length;
+            }
+
+            offset += length + random.range(16, 48);
+        }
+
+        finishIPS(result, size, end);
+        return result;
+    }
+
+    // Back to back RLE records of the largest size IPS allows
+    Case ipsLargeRLE(usize size) {
+        Case result{makeInput(size, 3), {'P', 'A', 'T', 'C', 'H'}};
+        const usize end = std::min(size, ipsLimit);
+        Random random(4);
+
+        for (usize offset = 0; offset < end;) {
+            const usize length = std::min<usize>(0xFFFF, end - offset);
+            writeBE(result.patch, offset == Hips::IPS::endOfFile ? offset - 1 : offset, 3);
+            writeBE(result.patch, 0, 2);
+            writeBE(result.patch, length, 2);
+            result.patch.push_back(u8(random.next()));
+            result.operations++;
+            offset += length;
+        }
+
+        finishIPS(result, size, end);
+        return result;
+    }
+
+    // Long XOR runs with short unchanged stretches between them, so most of the output comes from the patch
+    Case upsLongRuns(usize size) {
+        Case result{makeInput(size, 5), {'U', 'P', 'S', '1'}, size};
+        Bytes target = result.input;
+        Random random(6);
+
+        Hips::Detail::writeRunLength(result.patch, size);
+        Hips::Detail::writeRunLength(result.patch, size);
+
+        usize offset = 0;
+        while (true) {
+            const usize skip = random.range(0, 4096);
+            if (offset + skip >= size) {
+                break;
+            }
+
+            Hips::Detail::writeRunLength(result.patch, skip);
+            offset += skip;
+
+            // Runs end at the first 0 byte, which also XORs the byte after them
+            const usize length = std::min(random.range(4096, 65536), size - offset);
+            for (usize i = 0; i < length; i++) {
+                const u8 value = u8(random.next() | 1);
+                result.patch.push_back(value);
+                target[offset + i] ^= value;
+            }
+
+            result.patch.push_back(0);
+            result.operations++;
+            offset += length + 1;
+        }
+
+        Hips::Detail::writeLE32(result.patch, Hips::crc32(result.input.data(), size));
+        Hips::Detail::writeLE32(result.patch, Hips::crc32(target.data(), size));
+        Hips::Detail::writeLE32(result.patch, Hips::crc32(result.patch.data(), result.patch.size()));
+        return result;
+    }
+
+    // Builds a BPS patch out of actions, producing the target alongside it for the checksum
+    class BPSBuilder {
+        enum Action { SourceRead, TargetRead, SourceCopy, TargetCopy };
+
+        const Bytes& source;
+        Bytes actions;
+        usize sourceOffset = 0;
+        usize targetOffset = 0;
+
+        void writeAction(Action action, usize length) { Hips::Detail::writeRunLength(actions, ((length - 1) << 2) | action); }
+
+        void writeOffset(usize& relative, usize offset) {
+            const bool negative = offset < relative;
+            const usize distance = negative ? relative - offset : offset - relative;
+            Hips::Detail::writeRunLength(actions, (distance << 1) | (negative ? 1 : 0));
+        }
+
+      public:
+        Bytes target;
+        usize operations = 0;
+
+        explicit BPSBuilder(const Bytes& source) : source(source) {}
+
+        void sourceRead(usize length) {
+            writeAction(SourceRead, length);
+            target.insert(target.end(), source.begin() + target.size(), source.begin() + target.size() + length);
+            operations++;
+        }
+
+        void targetRead(Random& random, usize length) {
+            writeAction(TargetRead, length);
+            const usize start = actions.size();
+            actions.resize(start + length);
+            random.fill(actions.data() + start, length);
+            target.insert(target.end(), actions.begin() + start, actions.end());
+            operations++;
+        }
+
+        void sourceCopy(usize from, usize length) {
+            writeAction(SourceCopy, length);
+            writeOffset(sourceOffset, from);
+            target.insert(target.end(), source.begin() + from, source.begin() + from + length);
+            sourceOffset = from + length;
+            operations++;
+        }
+
+        // Copies byte by byte, since the copy can overlap the bytes it's writing
+        void targetCopy(usize from, usize length) {
+            writeAction(TargetCopy, length);
+            writeOffset(targetOffset, from);
+            for (usize i = 0; i < length; i++) {
+                target.push_back(target[from + i]);
+            }
+
+            targetOffset = from + length;
+            operations++;
+        }
+
+        Bytes finish() {
+            Bytes patch = {'B', 'P', 'S', '1'};
+            Hips::Detail::writeRunLength(patch, source.size());
+            Hips::Detail::writeRunLength(patch, target.size());
+            Hips::Detail::writeRunLength(patch, 0);  // No metadata
+            patch.insert(patch.end(), actions.begin(), actions.end());
+
+            Hips::Detail::writeLE32(patch, Hips::crc32(source.data(), source.size()));
+            Hips::Detail::writeLE32(patch, Hips::crc32(target.data(), target.size()));
+            Hips::Detail::writeLE32(patch, Hips::crc32(patch.data(), patch.size()));
+            return patch;
+        }
+    };
+
+    // Lots of tiny actions of every kind, which stresses decoding the actions rather than copying
+    Case bpsDenseActions(usize size) {
+        Case result{makeInput(size, 7), {}};
+        BPSBuilder builder(result.input);
+        Random random(8);
+
+        while (builder.target.size() < size) {
+            const usize length = std::min(random.range(1, 16), size - builder.target.size());
+            const usize written = builder.target.size();
+
+            switch (random.next() % 4) {
+                case 0: builder.sourceRead(length); break;
+                case 1: builder.targetRead(random, length); break;
+                case 2: builder.sourceCopy(random.range(0, size - length), length); break;
+                default:
+                    if (written == 0) {
+                        builder.sourceRead(length);
+                    } else {
+                        builder.targetCopy(random.range(0, written - 1), length);
+                    }
+                    break;
+            }
+        }
+
+        result.patch = builder.finish();
+        result.outputSize = builder.target.size();
+        result.operations = builder.operations;
+        return result;
+    }
+
+    // Long copies from all over the source, like data that got moved around
+    Case bpsLongCopies(usize size) {
+        Case result{makeInput(size, 9), {}};
+        BPSBuilder builder(result.input);
+        Random random(10);
+
+        while (builder.target.size() < size) {
+            const usize length = std::min(random.range(65536, 1 << 20), size - builder.target.size());
+            builder.sourceCopy(random.range(0, size - length), length);
+        }
+
+        result.patch = builder.finish();
+        result.outputSize = builder.target.size();
+        result.operations = builder.operations;
+        return result;
+    }
+
+    // A few new bytes, then a long TargetCopy of them that overlaps what it's writing, which is how BPS encodes repeated
+    // patterns
+    Case bpsOverlappingCopies(usize size) {
+        Case result{makeInput(size, 11), {}};
+        BPSBuilder builder(result.input);
+        Random random(12);
+
+        while (builder.target.size() < size) {
+            const usize pattern = std::min(random.range(1, 8), size - builder.target.size());
+            builder.targetRead(random, pattern);
+
+            const usize remaining = size - builder.target.size();
+            if (remaining > 0) {
+                const usize from = builder.target.size() - pattern;
+                builder.targetCopy(from, std::min(random.range(4096, 65536), remaining));
+            }
+        }
+
+        result.patch = builder.finish();
+        result.outputSize = builder.target.size();
+        result.operations = builder.operations;
+        return result;
+    }
+
+    // Written to so the compiler can't drop the CRC calculations
+    std::uint32_t checksum;
+
+    struct Benchmark {
+        const char* name;
+        const char* function;
+        std::function<Case(usize)> make;
+        std::function<bool(const Case&)> run;  // Returns false if patching failed
+    };
+
+    bool patched(const Case& c, const std::pair<Bytes, Hips::Result>& result) {
+        return result.second == Hips::Result::Success && result.first.size() == c.outputSize;
+    }
+
+    bool runIPS(const Case& c) { return patched(c, Hips::patchIPS(c.input.data(), c.input.size(), c.patch.data(), c.patch.size())); }
+    bool runUPS(const Case& c) { return patched(c, Hips::patchUPS(c.input.data(), c.input.size(), c.patch.data(), c.patch.size())); }
+    bool runBPS(const Case& c) { return patched(c, Hips::patchBPS(c.input.data(), c.input.size(), c.patch.data(), c.patch.size())); }
+
+    const std::vector<Benchmark> benchmarks = {
+        {"ips/small-records", "patchIPS", ipsSmallRecords, runIPS},
+        {"ips/large-rle", "patchIPS", ipsLargeRLE, runIPS},
+        {"ups/long-runs", "patchUPS", upsLongRuns, runUPS},
+        {"bps/dense-actions", "patchBPS", bpsDenseActions, runBPS},
+        {"bps/long-copies", "patchBPS", bpsLongCopies, runBPS},
+        {"bps/overlapping-copies", "patchBPS", bpsOverlappingCopies, runBPS},
+        // The "patch" is unused, and every byte counts as an operation
+        {"crc32", "Detail::crc32",
+         [](usize size) { return Case{makeInput(size, 13), {}, size, size}; },
+         [](const Case& c) {
+             checksum = Hips::Detail::crc32(c.input.data(), c.input.size());
+             return true;
+         }},
+    };
+
+    struct Measurement {
+        const Benchmark* benchmark;
+        usize size = 0;
+        usize patchSize = 0;
+        usize iterations = 0;
+        double seconds = 0;  // Fastest iteration
+        double megabytesPerSecond = 0;
+        double nanosecondsPerOperation = 0;
+        std::uint64_t allocations = 0;  // Per iteration
+        std::uint64_t allocatedBytes = 0;
+        std::uint64_t peakMemory = 0;
+        bool succeeded = true;
+    };
+
+    Measurement measure(const Benchmark& benchmark, usize size, double minimumSeconds) {
+        const Case c = benchmark.make(size);
+        Measurement result{&benchmark, size, c.patch.size()};
+
+        resetPeakMemory();
+        const std::uint64_t startCount = allocationCount.load();
+        const std::uint64_t startBytes = allocatedBytes.load();
+
+        // Run until enough time has passed to smooth out noise, at least twice so the first run's page faults don't decide
+        // the result
+        double total = 0;
+        double best = 1e30;
+
+        while (result.iterations < 2 || total < minimumSeconds) {
+            const auto start = std::chrono::steady_clock::now();
+            result.succeeded &= benchmark.run(c);
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            total += elapsed;
+            best = std::min(best, elapsed);
+            result.iterations++;
+        }
+
+        result.seconds = best;
+        result.megabytesPerSecond = double(c.outputSize) / best / 1e6;
+        result.nanosecondsPerOperation = c.operations == 0 ? 0 : best * 1e9 / double(c.operations);
+        result.allocations = (allocationCount.load() - startCount) / result.iterations;
+        result.allocatedBytes = (allocatedBytes.load() - startBytes) / result.iterations;
+        result.peakMemory = peakMemory();
+        return result;
+    }
+
+    // Parses sizes like "64K", "16M" or "2G"
+    bool parseSize(const std::string& text, usize& size) {
+        char* end;
+        const unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+        if (end == text.c_str()) {
+            return false;
+        }
+
+        switch (*end) {
+            case '\0': size = usize(value); return true;
+            case 'K': case 'k': size = usize(value) << 10; break;
+            case 'M': case 'm': size = usize(value) << 20; break;
+            case 'G': case 'g': size = usize(value) << 30; break;
+            default: return false;
+        }
+
+        return end[1] == '\0';
+    }
+
+    void writeJSON(std::FILE* file, const std::vector<Measurement>& measurements) {
+        std::fprintf(file, "{\n  \"results\": [\n");
+        for (usize i = 0; i < measurements.size(); i++) {
+            const Measurement& m = measurements[i];
+            std::fprintf(
+                file,
+                "    {\"name\": \"%s\", \"function\": \"%s\", \"size\": %zu, \"patch_size\": %zu, \"iterations\": %zu, "
+                "\"seconds\": %.9f, \"mb_per_s\": %.3f, \"ns_per_op\": %.3f, \"allocations\": %llu, \"allocated_bytes\": %llu, "
+                "\"peak_rss_bytes\": %llu, \"success\": %s}%s\n",
+                m.benchmark->name, m.benchmark->function, m.size, m.patchSize, m.iterations, m.seconds, m.megabytesPerSecond,
+                m.nanosecondsPerOperation, (unsigned long long)m.allocations, (unsigned long long)m.allocatedBytes,
+                (unsigned long long)m.peakMemory, m.succeeded ? "true" : "false", i + 1 == measurements.size() ? "" : ","
+            );
+        }
+        std::fprintf(file, "  ]\n}\n");
+    }
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<usize> sizes = {64 << 10, 1 << 20, 16 << 20, 256 << 20};
+    std::string filter;
+    const char* jsonPath = nullptr;
+    double minimumSeconds = 0.5;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--sizes" && hasValue) {
+            sizes.clear();
+            std::string list = argv[++i];
+
+            for (usize start = 0; start <= list.size();) {
+                const usize end = std::min(list.find(',', start), list.size());
+                usize size;
+
+                if (!parseSize(list.substr(start, end - start), size) || size == 0) {
+                    std::printf("Invalid size in \"%s\"\n", list.c_str());
+                    return -1;
+                }
+
+                sizes.push_back(size);
+                start = end + 1;
+            }
+        } else if (argument == "--filter" && hasValue) {
+            filter = argv[++i];
+        } else if (argument == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else if (argument == "--min-time" && hasValue) {
+            minimumSeconds = std::atof(argv[++i]);
+        } else {
+            std::printf(
+                "Usage: ./hips_benchmark [--sizes 64K,1M,16M,256M,4G] [--filter name] [--json output path, - for stdout]\n"
+                "                        [--min-time seconds per benchmark]\n"
+            );
+            return argument == "--help" ? 0 : -1;
+        }
+    }
+
+    // With JSON going to stdout, the table goes to stderr so the JSON can be piped somewhere
+    const bool jsonToStdout = jsonPath != nullptr && std::string(jsonPath) == "-";
+    std::FILE* table = jsonToStdout ? stderr : stdout;
+    std::vector<Measurement> measurements;
+    bool succeeded = true;
+
+    std::fprintf(table, "%-24s %10s %12s %12s %10s %14s %12s\n", "benchmark", "size", "MB/s", "ns/op", "allocs", "alloc bytes", "peak RSS MB");
+    for (const Benchmark& benchmark : benchmarks) {
+        if (std::string(benchmark.name).find(filter) == std::string::npos) {
+            continue;
+        }
+
+        for (usize size : sizes) {
+            const Measurement m = measure(benchmark, size, minimumSeconds);
+            std::fprintf(
+                table, "%-24s %10zu %12.1f %12.2f %10llu %14llu %12.1f%s\n", benchmark.name, size, m.megabytesPerSecond,
+                m.nanosecondsPerOperation, (unsigned long long)m.allocations, (unsigned long long)m.allocatedBytes,
+                double(m.peakMemory) / (1 << 20), m.succeeded ? "" : "  FAILED"
+            );
+
+            succeeded &= m.succeeded;
+            measurements.push_back(m);
+        }
+    }
+
+    if (jsonPath != nullptr) {
+        std::FILE* file = jsonToStdout ? stdout : std::fopen(jsonPath, "w");
+        if (file == nullptr) {
+            std::printf("Failed to open %s\n", jsonPath);
+            return -1;
+        }
+
+        writeJSON(file, measurements);
+        if (!jsonToStdout) {
+            std::fclose(file);
+        }
+    }
+
+    // Patching failures mean the generated patches or the patchers are broken, so they fail the run for CI
+    return succeeded ? 0 : 1;
+}
@@ -1,41 +1,104 @@
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <filesystem>
-#include <memory>
+#include <span>
+#include <vector>
 
 #include "../../include/hips.hpp"
+#include "../utils/directory_cache.hpp"
 #include "../utils/io_file.hpp"
+#include "../utils/mapped_file.hpp"
+#include "../utils/stream_file.hpp"
+
+// Only writes the parts of the output the patch changes, either on top of a copy of the input or on top of the input itself,
+// so patching a large file with a small patch only takes as much I/O as the patch
+static Hips::Result patchRanges(
+    const MappedFile& input, const std::filesystem::path& inputPath, const MappedFile& patch, Hips::PatchType patchType,
+    const std::filesystem::path* outputPath
+) {
+    auto [outputSize, sizeResult] = Hips::queryOutputSize(patch.data(), patch.size(), patchType);
+    if (sizeResult != Hips::Result::Success) {
+        return sizeResult;
+    }
+
+    IOFile output;
+    if (outputPath == nullptr) {
+        if (!Hips::canPatchInPlace(patch.data(), patch.size(), patchType)) {
+            std::printf("This patch reads parts of the input after overwriting them, so it can't be applied in place\n");
+            return Hips::Result::IOError;
+        }
+
+        if (!output.open(inputPath, "r+b")) {
+            return Hips::Result::IOError;
+        }
+    } else {
+        // Reflinked where the file system allows it, so the untouched parts of the input aren't even copied
+        IOFile source(inputPath, "rb");
+        if (!output.open(*outputPath, "w+b") || !output.copyFrom(source)) {
+            return Hips::Result::IOError;
+        }
+    }
+
+    // Grow the file first so any of it past the end of the input is 0s, and trim it afterwards, as the patch can still
+    // read the end of the input when patching in place
+    if (outputSize > input.size() && !output.setSize(outputSize)) {
+        return Hips::Result::IOError;
+    }
+
+    RangeFileSink sink(output);
+    const Hips::Result result = Hips::patchRanges(input.data(), input.size(), patch.data(), patch.size(), patchType, sink);
+
+    if (result == Hips::Result::Success && !output.setSize(outputSize)) {
+        return Hips::Result::IOError;
+    }
+
+    return result;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::printf("Invalid arguments. Usage: ./main <input file path> <patch path>\n");
+    std::vector<const char*> paths;
+    const char* cacheDirectory = nullptr;
+    bool ranges = false;
+    bool inPlace = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--ranges") == 0) {
+            ranges = true;
+        } else if (std::strcmp(argv[i], "--in-place") == 0) {
+            inPlace = true;
+        } else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+
+    if (paths.size() < 2 || paths.size() > 3 || (inPlace && paths.size() != 2) || (ranges && paths.size() != 3) ||
+        (cacheDirectory != nullptr && (ranges || inPlace))) {
+        std::printf(
+            "Invalid arguments. Usage: ./main <input file path> <patch path> [output path] [--ranges | --cache <directory>]\n"
+            "                          ./main <input file path> <patch path> --in-place\n"
+            "--ranges copies the input to the output and only writes the parts of it the patch changes, and --in-place does\n"
+            "the same to the input file itself. --cache keeps patched files in a directory, and reuses them when the same\n"
+            "input and patch come up again\n"
+        );
         return -1;
     }
 
     // Retrieve the paths of the input file and the patch file
-    auto inputPath = std::filesystem::path(argv[1]);
-    auto patchPath = std::filesystem::path(argv[2]);
+    auto inputPath = std::filesystem::path(paths[0]);
+    auto patchPath = std::filesystem::path(paths[1]);
 
-    IOFile input(inputPath, "rb");
-    IOFile patch(patchPath, "rb");
+    // Map the input and the patch instead of reading them, so they're used straight from the page cache
+    MappedFile input(inputPath);
+    MappedFile patch(patchPath);
 
     if (!input.isOpen() || !patch.isOpen()) {
         std::printf("Failed to open input or patch file.\n");
         return -1;
     }
 
-    // Read the files into arrays
-    const auto inputSize = *input.size();
-    const auto patchSize = *patch.size();
-
-    std::unique_ptr<uint8_t[]> inputData(new uint8_t[inputSize]);
-    std::unique_ptr<uint8_t[]> patchData(new uint8_t[patchSize]);
-
-    input.rewind();
-    patch.rewind();
-    input.readBytes(inputData.get(), inputSize);
-    patch.readBytes(patchData.get(), patchSize);
-
     // Finally, detect the patch type, do the patching and check for errors
     Hips::PatchType patchType;
     auto extension = patchPath.extension();
@@ -51,7 +114,54 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    auto [bytes, result] = Hips::patch(inputData.get(), inputSize, patchData.get(), patchSize, patchType);
+    // Patches are read front to back, and so is the input except for BPS patches, which can copy from anywhere in it. When only
+    // the changed ranges are written, only the parts of the input they come from are read
+    patch.advise(MappedFile::Hint::Sequential);
+    if (ranges || inPlace) {
+        input.advise(MappedFile::Hint::Random);
+    } else {
+        input.advise(patchType == Hips::PatchType::BPS ? MappedFile::Hint::WillNeed : MappedFile::Hint::Sequential);
+    }
+
+    Hips::Result result;
+    if (cacheDirectory != nullptr) {
+        DirectoryCache cache(cacheDirectory);
+        auto [output, cacheResult] = Hips::patchCached(cache, input.data(), input.size(), patch.data(), patch.size(), patchType);
+        result = cacheResult;
+
+        if (result == Hips::Result::Success && paths.size() == 3) {
+            IOFile outputFile(std::filesystem::path(paths[2]), "wb");
+            auto [success, written] = outputFile.writeBytes(output.data.data(), output.data.size());
+            result = (success && written == output.data.size()) ? result : Hips::Result::IOError;
+        }
+
+        std::printf("%s\n", cache.stats().hits != 0 ? "Found in the cache" : "Not in the cache");
+    } else if (ranges || inPlace) {
+        const auto outputPath = inPlace ? std::filesystem::path() : std::filesystem::path(paths[2]);
+        result = patchRanges(input, inputPath, patch, patchType, inPlace ? nullptr : &outputPath);
+    } else if (paths.size() == 3) {
+        // The size of the patched file is known before patching, so the output file is created with that size up front and
+        // the patched bytes are written straight into its pages
+        auto [outputSize, sizeResult] = Hips::queryOutputSize(patch.data(), patch.size(), patchType);
+        MappedFile output;
+
+        if (sizeResult != Hips::Result::Success) {
+            result = sizeResult;
+        } else if (!output.create(std::filesystem::path(paths[2]), outputSize)) {
+            std::printf("Failed to open output file.\n");
+            return -1;
+        } else {
+            auto outputData = std::span<uint8_t>(output.data(), outputSize);
+            result = Hips::patchInto(outputData, input.data(), input.size(), patch.data(), patch.size(), patchType);
+        }
+    } else {
+        // Otherwise the patched file is only kept in memory. Every byte of it gets written, so it doesn't need to be zeroed first
+        auto [bytes, patchResult] = Hips::patch<Hips::ReadPolicy::Checked, Hips::DefaultInitAllocator<uint8_t>>(
+            input.data(), input.size(), patch.data(), patch.size(), patchType
+        );
+        result = patchResult;
+    }
+
     if (result == Hips::Result::Success) {
         printf("Patch applied successfully\n");
         return 0;
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <span>
+#include <string>
+#include <system_error>
+
+#include "../../include/hips.hpp"
+#include "io_file.hpp"
+#include "mapped_file.hpp"
+
+// Hips::Cache that keeps every output in a file of its own, so they outlive the process and can be shared between processes.
+// Cached outputs are memory-mapped instead of read, so a hit only reads the parts of the output that actually get used
+class DirectoryCache final : public Hips::Cache {
+    std::filesystem::path directory;
+
+    std::filesystem::path pathFor(const Hips::CacheKey& key) const {
+        static constexpr const char* typeNames[] = { "ips", "ups", "bps" };
+        char name[96];
+
+        std::snprintf(
+            name, sizeof(name), "%s-%08x-%016llx-%08x-%016llx.out", typeNames[std::size_t(key.type) % 3], unsigned(key.inputCRC),
+            (unsigned long long)key.inputSize, unsigned(key.patchCRC), (unsigned long long)key.patchSize
+        );
+        return directory / name;
+    }
+
+public:
+    explicit DirectoryCache(const std::filesystem::path& directory) : directory(directory) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+
+protected:
+    bool lookup(const Hips::CacheKey& key, Hips::CachedOutput& output) override {
+        auto file = std::make_shared<MappedFile>();
+        if (!file->open(pathFor(key))) {
+            return false;
+        }
+
+        output = { std::span<const std::uint8_t>(file->data(), std::size_t(file->size())), file };
+        return true;
+    }
+
+    // Outputs are written to a temporary file that then gets renamed into place, so nothing ever sees half of one
+    void insert(const Hips::CacheKey& key, const Hips::CachedOutput& output) override {
+        const auto path = pathFor(key);
+        auto temporary = path;
+        temporary += ".tmp" + std::to_string(std::random_device{}());
+
+        IOFile file(temporary, "wb");
+        if (!file.isOpen()) {
+            return;
+        }
+
+        const auto [success, written] = file.writeBytes(output.data.data(), output.data.size());
+        file.close();
+
+        std::error_code error;
+        if (success && written == output.data.size()) {
+            std::filesystem::rename(temporary, path, error);
+        }
+
+        if (!success || written != output.data.size() || error) {
+            std::filesystem::remove(temporary, error);
+        }
+    }
+};
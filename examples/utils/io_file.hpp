@@ -1,9 +1,12 @@
 #pragma once
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <filesystem>
 #include <optional>
 #include <utility>
+#include <vector>
 
 #ifdef _MSC_VER
 // 64 bit offsets for MSVC
@@ -21,7 +24,12 @@
 #if defined(WIN32) || defined(_WIN32)
 #include <io.h> // For _chsize_s
 #else
-#include <unistd.h> // For ftruncate
+#include <unistd.h> // For ftruncate, pread, pwrite and copy_file_range
+#endif
+
+#if defined(__linux__)
+#include <linux/fs.h> // For FICLONE
+#include <sys/ioctl.h>
 #endif
 
 class IOFile {
@@ -125,4 +133,100 @@ public:
         fflush(handle);
         return success;
     }
+
+    // Reads "count" bytes at "offset" without moving the file position, so the file can be read anywhere without seeking
+    // back and forth. Returns whether all of them were read
+    bool readAt(std::uint64_t offset, void* data, std::size_t count) {
+        if (!isOpen()) return false;
+        fflush(handle); // Anything still in the stdio buffer has to be written before it can be read back
+
+#if defined(WIN32) || defined(_WIN32)
+        auto [success, readCount] = seek(std::int64_t(offset)) ? readBytes(data, count) : std::pair<bool, std::size_t>{ false, 0 };
+        return success && readCount == count;
+#else
+        auto bytes = static_cast<std::uint8_t*>(data);
+        while (count > 0) {
+            const ssize_t result = pread(fileno(handle), bytes, count, off_t(offset));
+            if (result <= 0) {
+                if (result < 0 && errno == EINTR) continue;
+                return false;
+            }
+
+            bytes += result;
+            offset += result;
+            count -= result;
+        }
+
+        return true;
+#endif
+    }
+
+    // Writes "count" bytes at "offset" without moving the file position, for writing all over a file without seeking for every
+    // write. Bypasses the stdio buffer, so reads through it should seek first. Returns whether all of them were written
+    bool writeAt(std::uint64_t offset, const void* data, std::size_t count) {
+        if (!isOpen()) return false;
+        fflush(handle);
+
+#if defined(WIN32) || defined(_WIN32)
+        auto [success, written] = seek(std::int64_t(offset)) ? writeBytes(data, count) : std::pair<bool, std::size_t>{ false, 0 };
+        return success && written == count;
+#else
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        while (count > 0) {
+            const ssize_t result = pwrite(fileno(handle), bytes, count, off_t(offset));
+            if (result <= 0) {
+                if (result < 0 && errno == EINTR) continue;
+                return false;
+            }
+
+            bytes += result;
+            offset += result;
+            count -= result;
+        }
+
+        return true;
+#endif
+    }
+
+    // Replaces the contents of this file with those of "source". On file systems that support reflinks (Btrfs, XFS...) the
+    // copy shares the source's data instead of duplicating it, otherwise it's copied inside the kernel where possible, and
+    // only read and written back as a last resort
+    bool copyFrom(IOFile& source) {
+        const auto sourceSize = source.size();
+        if (!isOpen() || !sourceSize || !setSize(0)) return false;
+        fflush(source.handle);
+
+        std::uint64_t copied = 0;
+#if defined(__linux__)
+        if (ioctl(fileno(handle), FICLONE, fileno(source.handle)) == 0) {
+            return true;
+        }
+
+        // Not every file system or kernel supports copy_file_range, in which case it fails without copying anything
+        while (copied < *sourceSize) {
+            loff_t sourceOffset = loff_t(copied);
+            loff_t destOffset = loff_t(copied);
+            const ssize_t result = copy_file_range(fileno(source.handle), &sourceOffset, fileno(handle), &destOffset, *sourceSize - copied, 0);
+
+            if (result <= 0) {
+                if (result < 0 && errno == EINTR) continue;
+                break;
+            }
+
+            copied += result;
+        }
+#endif
+
+        std::vector<std::uint8_t> buffer(std::size_t(std::min<std::uint64_t>(*sourceSize - copied, 1024 * 1024)));
+        while (copied < *sourceSize) {
+            const std::size_t count = std::size_t(std::min<std::uint64_t>(buffer.size(), *sourceSize - copied));
+            if (!source.readAt(copied, buffer.data(), count) || !writeAt(copied, buffer.data(), count)) {
+                return false;
+            }
+
+            copied += count;
+        }
+
+        return true;
+    }
 };
\ No newline at end of file
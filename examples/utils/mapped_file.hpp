@@ -0,0 +1,214 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+
+#if defined(WIN32) || defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Companion to IOFile which maps a whole file into memory instead of going through fread/fwrite, so files can be patched
+// straight from (and into) the page cache without copying them into heap buffers first
+class MappedFile {
+    std::uint8_t* pointer = nullptr;
+    std::uint64_t mappedSize = 0;
+    bool writable = false;
+
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    bool map() {
+        // Empty files can't be mapped, but there's nothing to access in them anyway
+        if (mappedSize == 0) {
+            return true;
+        }
+
+#if defined(WIN32) || defined(_WIN32)
+        const DWORD protection = writable ? PAGE_READWRITE : PAGE_READONLY;
+        mapping = CreateFileMappingW(file, nullptr, protection, DWORD(mappedSize >> 32), DWORD(mappedSize), nullptr);
+        if (mapping == nullptr) {
+            return false;
+        }
+
+        pointer = (std::uint8_t*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+#else
+        void* address = mmap(nullptr, mappedSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+        pointer = (address == MAP_FAILED) ? nullptr : (std::uint8_t*)address;
+#endif
+        return pointer != nullptr;
+    }
+
+    void unmap() {
+#if defined(WIN32) || defined(_WIN32)
+        if (pointer != nullptr) UnmapViewOfFile(pointer);
+        if (mapping != nullptr) CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        if (pointer != nullptr) munmap(pointer, mappedSize);
+#endif
+        pointer = nullptr;
+    }
+
+    bool openHandle(const std::filesystem::path& path, bool create) {
+#if defined(WIN32) || defined(_WIN32)
+        const DWORD access = writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+        file = CreateFileW(path.c_str(), access, FILE_SHARE_READ, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return file != INVALID_HANDLE_VALUE;
+#else
+        const auto str = path.string();
+        fd = ::open(str.c_str(), writable ? (O_RDWR | (create ? (O_CREAT | O_TRUNC) : 0)) : O_RDONLY, 0644);
+        return fd != -1;
+#endif
+    }
+
+    bool setFileSize(std::uint64_t size) {
+#if defined(WIN32) || defined(_WIN32)
+        LARGE_INTEGER distance;
+        distance.QuadPart = LONGLONG(size);
+        return SetFilePointerEx(file, distance, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+#else
+        return ftruncate(fd, off_t(size)) == 0;
+#endif
+    }
+
+public:
+    enum class Access { Read, ReadWrite };
+
+    // How the mapping is going to be accessed, so the OS can read ahead accordingly
+    enum class Hint {
+        Normal,
+        Sequential,  // Front to back, eg the patch, or the input of an IPS/UPS patch
+        Random,      // All over the place, eg the input of a BPS patch
+        WillNeed,    // All of it, soon. Starts reading it in the background
+    };
+
+    MappedFile() {}
+    MappedFile(const std::filesystem::path& path, Access access = Access::Read) {
+        open(path, access);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool isOpen() const {
+#if defined(WIN32) || defined(_WIN32)
+        return file != INVALID_HANDLE_VALUE;
+#else
+        return fd != -1;
+#endif
+    }
+
+    // Maps an existing file in its entirety
+    bool open(const std::filesystem::path& path, Access access = Access::Read) {
+        close();
+        writable = access == Access::ReadWrite;
+        if (!openHandle(path, false)) {
+            return false;
+        }
+
+#if defined(WIN32) || defined(_WIN32)
+        LARGE_INTEGER size;
+        const bool gotSize = GetFileSizeEx(file, &size);
+        mappedSize = std::uint64_t(size.QuadPart);
+#else
+        struct stat status;
+        const bool gotSize = fstat(fd, &status) == 0;
+        mappedSize = std::uint64_t(status.st_size);
+#endif
+        if (!gotSize || !map()) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Creates a file of "size" bytes (replacing any existing one) and maps it for writing
+    bool create(const std::filesystem::path& path, std::uint64_t size) {
+        close();
+        writable = true;
+
+        if (!openHandle(path, true) || !resize(size)) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    // Changes the size of a writable file and maps it again. This can move the mapping, so pointers into it are invalidated
+    bool resize(std::uint64_t size) {
+        if (!isOpen() || !writable) return false;
+
+        unmap();
+        mappedSize = size;
+        return setFileSize(size) && map();
+    }
+
+    void advise(Hint hint) {
+        if (pointer == nullptr) return;
+
+#if defined(WIN32) || defined(_WIN32)
+        // Windows only has an equivalent for WillNeed
+        if (hint == Hint::WillNeed) {
+            WIN32_MEMORY_RANGE_ENTRY range{pointer, SIZE_T(mappedSize)};
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        }
+#else
+        int advice = MADV_NORMAL;
+        switch (hint) {
+            case Hint::Normal: advice = MADV_NORMAL; break;
+            case Hint::Sequential: advice = MADV_SEQUENTIAL; break;
+            case Hint::Random: advice = MADV_RANDOM; break;
+            case Hint::WillNeed: advice = MADV_WILLNEED; break;
+        }
+
+        madvise(pointer, mappedSize, advice);
+#endif
+    }
+
+    void close() {
+        unmap();
+        mappedSize = 0;
+
+#if defined(WIN32) || defined(_WIN32)
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    std::uint8_t* data() {
+        return pointer;
+    }
+
+    const std::uint8_t* data() const {
+        return pointer;
+    }
+
+    std::uint64_t size() const {
+        return mappedSize;
+    }
+};
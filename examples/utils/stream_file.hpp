@@ -0,0 +1,110 @@
+#pragma once
+#include <cstdint>
+
+#include "../../include/hips.hpp"
+#include "io_file.hpp"
+#include "mapped_file.hpp"
+
+// Adapters for streaming patches straight from and to files with Hips::Stream, without loading them into memory
+class FileSource : public Hips::Stream::Source {
+    IOFile& file;
+    std::uint64_t fileSize;
+    std::uint64_t position = ~std::uint64_t(0);  // Where the file position is, so that sequential reads don't seek and drop the stdio buffer
+
+public:
+    FileSource(IOFile& file) : file(file), fileSize(file.size().value_or(0)) {}
+
+    std::uint64_t size() const override {
+        return fileSize;
+    }
+
+    bool read(std::uint64_t offset, std::uint8_t* dest, std::size_t length) override {
+        if (offset != position && !file.seek(std::int64_t(offset))) {
+            return false;
+        }
+
+        auto [success, count] = file.readBytes(dest, length);
+        position = offset + count;
+        return success && count == length;
+    }
+};
+
+// The file needs to be opened for both writing and reading (eg "w+b"), as BPS patches can copy from earlier output
+class FileSink : public Hips::Stream::Sink {
+    IOFile& file;
+
+public:
+    FileSink(IOFile& file) : file(file) {}
+
+    bool write(std::uint64_t offset, const std::uint8_t* data, std::size_t length) override {
+        if (!file.seek(std::int64_t(offset))) {
+            return false;
+        }
+
+        auto [success, count] = file.writeBytes(data, length);
+        return success && count == length;
+    }
+
+    bool read(std::uint64_t offset, std::uint8_t* dest, std::size_t length) override {
+        if (!file.seek(std::int64_t(offset))) {
+            return false;
+        }
+
+        auto [success, count] = file.readBytes(dest, length);
+        return success && count == length;
+    }
+};
+
+// Writes the output straight into the pages of a mapped file, growing it as needed.
+// Call finish() once patching is done to trim the file down to the size of the output
+class MappedFileSink : public Hips::Stream::Sink {
+    MappedFile& file;
+    std::uint64_t outputSize = 0;
+
+public:
+    MappedFileSink(MappedFile& file) : file(file) {}
+
+    bool write(std::uint64_t offset, const std::uint8_t* data, std::size_t length) override {
+        if (offset + length > file.size()) {
+            // Grow geometrically so that streaming the output doesn't remap the file for every chunk
+            const std::uint64_t newSize = std::max<std::uint64_t>(offset + length, std::max<std::uint64_t>(file.size() * 2, 1024 * 1024));
+            if (!file.resize(newSize)) {
+                return false;
+            }
+        }
+
+        std::memcpy(file.data() + offset, data, length);
+        outputSize = std::max<std::uint64_t>(outputSize, offset + length);
+        return true;
+    }
+
+    bool read(std::uint64_t offset, std::uint8_t* dest, std::size_t length) override {
+        if (offset > outputSize || length > outputSize - offset) {
+            return false;
+        }
+
+        std::memcpy(dest, file.data() + offset, length);
+        return true;
+    }
+
+    bool finish() {
+        return file.resize(outputSize);
+    }
+};
+
+// Writes and reads back with positioned I/O instead of seeking, for Hips::patchRanges, which writes the changed parts of a
+// file all over it rather than front to back
+class RangeFileSink : public Hips::Stream::Sink {
+    IOFile& file;
+
+public:
+    RangeFileSink(IOFile& file) : file(file) {}
+
+    bool write(std::uint64_t offset, const std::uint8_t* data, std::size_t length) override {
+        return file.writeAt(offset, data, length);
+    }
+
+    bool read(std::uint64_t offset, std::uint8_t* dest, std::size_t length) override {
+        return file.readAt(offset, dest, length);
+    }
+};
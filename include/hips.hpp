@@ -27,13 +27,53 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HIPS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+// PMULL is part of the optional crypto extensions, so we can only use it if the compiler was told it's available
+#define HIPS_ARM_PMULL
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+// Lets us compile functions using instruction set extensions that aren't enabled for the rest of the program,
+// so that they can be picked at runtime. MSVC allows intrinsics for any instruction set without this
+#if defined(_MSC_VER) && !defined(__clang__)
+#define HIPS_TARGET(features)
+#else
+#define HIPS_TARGET(features) __attribute__((target(features)))
+#endif
+
 namespace Hips {
 	using u8 = std::uint8_t;
 	using u16 = std::uint16_t;
@@ -58,16 +98,201 @@ namespace Hips {
 		UnknownFormat,
 		SizeMismatch,
 		ChecksumMismatch,
+		IOError,
+	};
+
+	// How the input file and patch checksums stored in UPS and BPS patches are verified. The output checksum is always
+	// computed while the output is being written, so it never needs a separate pass
+	enum class Verification : u32 {
+		Eager,     // Checksum the input and the patch before applying anything
+		Parallel,  // Checksum the input and the patch on another thread while the patch is being applied
+	};
+
+	// How the patch appliers read from patches, passed to them as a template parameter
+	namespace ReadPolicy {
+		// Every read is bounds checked, and reading past the end of the patch rejects it as an InvalidPatch
+		struct Checked {
+			static constexpr bool checkReads = true;
+			static constexpr bool validateFirst = false;
+		};
+
+		// The patch's structure is validated in a single pass up front, after which reads are unchecked
+		struct Validated {
+			static constexpr bool checkReads = false;
+			static constexpr bool validateFirst = true;
+		};
+
+		// Reads are unchecked and nothing is validated. Only for patches that have already passed IPS/UPS/BPS::validate,
+		// eg by services that validate a patch once when they receive it and then apply it many times
+		struct Trusted {
+			static constexpr bool checkReads = false;
+			static constexpr bool validateFirst = false;
+		};
+	}  // namespace ReadPolicy
+
+	// What's wrong with a patch, in more detail than Result
+	enum class PatchError : u32 {
+		None,
+		BadHeader,         // Too small to be a patch of its type, or the magic bytes are wrong
+		Truncated,         // A record, hunk or action (or the header) goes past the end of the patch
+		IntegerOverflow,   // A run-length encoded integer doesn't fit in 64 bits
+		MissingEndOfFile,  // An IPS patch ends without its "EOF" marker
+		TrailingData,      // Something other than a 3 byte size comes after the "EOF" of an IPS patch
+		WritePastOutput,   // A BPS action writes past the output size in the header
+		OutputNotFilled,   // The BPS actions end before the output size in the header
+		SourceOutOfRange,  // A BPS SourceRead or SourceCopy reads past the input size in the header
+		TargetOutOfRange,  // A BPS TargetCopy reads output that hasn't been written yet
+		InputTooSmall,     // The input given to validate is smaller than the one in the header
+		PatchChecksum,     // The CRC32 of the patch doesn't match the one at its end
+	};
+
+	// What validate found out about a patch. The sizes and checksums are what the header says, as far as it could be read
+	struct ValidationReport {
+		Result result = Result::Success;
+		PatchError error = PatchError::None;
+		usize errorOffset = 0;  // Where in the patch the error is
+
+		u64 inputSize = 0;         // Always 0 for IPS patches, which don't store it
+		u64 outputSize = 0;        // For IPS patches, the size the patchers would make the output
+		u64 operationCount = 0;    // Records, hunks or actions
+		bool checksummed = false;  // IPS patches have no checksums
+		u32 inputCRC = 0;
+		u32 outputCRC = 0;
+	};
+
+	// Allocator that leaves the elements of a vector uninitialized instead of zeroing them. The patchers write every byte of
+	// their output, so passing this as their Allocator parameter saves a pass over the output that std::allocator would do
+	template <typename T>
+	struct DefaultInitAllocator : std::allocator<T> {
+		template <typename U>
+		struct rebind {
+			using other = DefaultInitAllocator<U>;
+		};
+
+		using std::allocator<T>::allocator;
+
+		template <typename U>
+		void construct(U* pointer) noexcept(std::is_nothrow_default_constructible_v<U>) {
+			::new ((void*)pointer) U;
+		}
+
+		template <typename U, typename... Args>
+		void construct(U* pointer, Args&&... args) {
+			::new ((void*)pointer) U(std::forward<Args>(args)...);
+		}
+	};
+
+	// What the patchers report to an Observer. Bytes are counted as they're written to the output
+	enum class PatchEvent : u32 {
+		IPSRecord,        // A record with its data in the patch
+		IPSRunLength,     // An RLE record
+		UPSCopy,          // Bytes copied unchanged from the input, either before a hunk or after the last one
+		UPSXor,           // Bytes XORed with the patch
+		BPSSourceRead,
+		BPSTargetRead,
+		BPSSourceCopy,
+		BPSTargetCopy,
+	};
+
+	static constexpr usize patchEventCount = 8;
+
+	// What the time spent patching goes to. Copy covers everything that writes the output, including XORing UPS hunks
+	enum class PatchPhase : u32 {
+		Decode,    // Reading records, hunks and actions from the patch
+		Copy,      // Writing the output
+		Checksum,  // Checking the input, patch and output checksums, or waiting for them with Verification::Parallel
+	};
+
+	static constexpr usize patchPhaseCount = 3;
+
+	// Observers are passed to the patchers as a template parameter (and by reference), and get told about every record,
+	// hunk or action they apply, where the time goes, how much they allocate and where in the patch they ran into errors.
+	// This one ignores all of it, and with "timed" false the patchers don't even read the clock, so it's free
+	struct NullObserver {
+		static constexpr bool timed = false;
+
+		void event(PatchEvent, u64) {}
+		void phase(PatchPhase, u64) {}
+		void allocated(u64) {}
+		void error(Result, usize) {}
+	};
+
+	// Observer that totals up everything the patchers report, for finding out which patches are slow and why. The same
+	// one can be passed to several patchers to total them all up
+	class PatchStats {
+	  public:
+		static constexpr bool timed = true;
+
+		void event(PatchEvent event, u64 bytes) {
+			eventCounts[usize(event)]++;
+			eventBytes[usize(event)] += bytes;
+		}
+
+		void phase(PatchPhase phase, u64 nanoseconds) { phaseTimes[usize(phase)] += nanoseconds; }
+		void allocated(u64 bytes) { allocatedBytes += bytes; }
+
+		// Only the first error is kept, since anything after it tends to be caused by it
+		void error(Result result, usize patchOffset) {
+			if (firstError == Result::Success) {
+				firstError = result;
+				firstErrorOffset = patchOffset;
+			}
+		}
+
+		u64 count(PatchEvent event) const { return eventCounts[usize(event)]; }
+		u64 bytes(PatchEvent event) const { return eventBytes[usize(event)]; }
+		u64 nanoseconds(PatchPhase phase) const { return phaseTimes[usize(phase)]; }
+		u64 allocations() const { return allocatedBytes; }
+
+		// The first error, and the offset in the patch of the record, hunk or action it was found in. Errors in the header
+		// are at offset 0, and checksum mismatches at the checksum that didn't match
+		Result error() const { return firstError; }
+		usize errorOffset() const { return firstErrorOffset; }
+
+	  private:
+		std::array<u64, patchEventCount> eventCounts{};
+		std::array<u64, patchEventCount> eventBytes{};
+		std::array<u64, patchPhaseCount> phaseTimes{};
+		u64 allocatedBytes = 0;
+		Result firstError = Result::Success;
+		usize firstErrorOffset = 0;
 	};
 
 	namespace Detail {
-		// Read "size" bytes, returning 0 if we're going to go out of bounds
-		template <typename T = u64, usize size>
+		// Default argument for the patchers' observer parameter
+		inline NullObserver nullObserver;
+
+		// Splits the time a patcher takes between the phases of patching, by charging the time since the last call to the
+		// phase that just finished. Doesn't read the clock at all for observers that aren't timed
+		template <typename Observer>
+		class PhaseClock {
+			Observer& observer;
+			std::chrono::steady_clock::time_point last;
+
+		  public:
+			explicit PhaseClock(Observer& observer) : observer(observer) {
+				if constexpr (Observer::timed) {
+					last = std::chrono::steady_clock::now();
+				}
+			}
+
+			void charge(PatchPhase phase) {
+				if constexpr (Observer::timed) {
+					const auto now = std::chrono::steady_clock::now();
+					observer.phase(phase, u64(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count()));
+					last = now;
+				}
+			}
+		};
+
+		// Read "size" bytes, returning 0 if we're going to go out of bounds. Either way the offset moves forward, so going
+		// out of bounds can be detected afterwards by checking if the offset went past the end of the data
+		template <typename T = u64, usize size, typename Policy = ReadPolicy::Checked>
 		T readBE(const u8* data, usize& offset, usize patchSize) {
 			static_assert(std::is_integral<T>() && sizeof(T) >= size);
 
 			offset += size;
-			if (offset > patchSize) {
+			if (Policy::checkReads && offset > patchSize) {
 				// We're going to go out of bounds, return 0
 				return T(0);
 			}
@@ -83,12 +308,12 @@ namespace Hips {
 			return ret;
 		}
 
-		template <typename T = u64, usize size>
+		template <typename T = u64, usize size, typename Policy = ReadPolicy::Checked>
 		T readLE(const u8* data, usize& offset, usize patchSize) {
 			static_assert(std::is_integral<T>() && sizeof(T) >= size);
 
 			offset += size;
-			if (offset > patchSize) {
+			if (Policy::checkReads && offset > patchSize) {
 				// We're going to go out of bounds, return 0
 				return T(0);
 			}
@@ -104,16 +329,70 @@ namespace Hips {
 			return ret;
 		}
 
+		// Read "size" bytes into dest, with anything past the end of the data reading as 0, the same as the helpers above
+		static void readBytes(u8* dest, const u8* data, usize& offset, usize dataSize, usize size) {
+			if (size == 0) {
+				return;
+			}
+
+			// An empty input can come without a buffer, which memcpy doesn't take even for 0 bytes
+			const usize available = offset < dataSize ? std::min<usize>(size, dataSize - offset) : 0;
+			if (available != 0) {
+				std::memcpy(dest, data + offset, available);
+			}
+			std::memset(dest + available, 0, size - available);
+			offset += size;
+		}
+
+		// Copy "length" bytes from source to dest with the same result as copying them one at a time, front to back.
+		// When the 2 overlap with source < dest, this means repeating the first (dest - source) bytes, which formats like BPS
+		// use for run-length encoding. We replicate the pattern with memcpys that double in size instead of going byte-by-byte
+		static void copyForward(u8* dest, const u8* source, usize length) {
+			const usize distance = usize(dest - source);
+			if (source >= dest || distance >= length) {
+				std::memmove(dest, source, length);
+				return;
+			}
+
+			if (distance == 1) {
+				std::memset(dest, source[0], length);
+				return;
+			}
+
+			// [source, dest + copied) always holds a whole number of periods, so copying from the start never overlaps
+			usize copied = 0;
+			while (copied < length) {
+				const usize chunk = std::min<usize>(distance + copied, length - copied);
+				std::memcpy(dest + copied, source, chunk);
+				copied += chunk;
+			}
+		}
+
+		// Sum of the +1 that the run-length encoding adds to every byte after the first, indexed by the encoding's length in bytes
+		static constexpr std::array<u64, 9> runLengthBias = [] {
+			std::array<u64, 9> bias{};
+			for (usize i = 2; i < bias.size(); i++) {
+				bias[i] = bias[i - 1] + (u64(1) << (7 * (i - 1)));
+			}
+
+			return bias;
+		}();
+
 		// Formats like UPS and BPS	use run-length encoded integers
 		// Regrettably, handling anything > 64 bits is not easy, or particularly worth it
 		// Until files start being larger than 18 exabytes that is
-		template <typename T = u64>
-		T readRunLength(const u8* data, usize& offset, usize patchSize) {
+		template <typename Policy = ReadPolicy::Checked>
+		u64 readRunLengthBytewise(const u8* data, usize& offset, usize patchSize) {
 			u64 ret = 0;
 			u64 shift = 1;
 
 			while (true) {
-				const u64 byte = readLE<u64, 1>(data, offset, patchSize);
+				const u64 byte = readLE<u64, 1, Policy>(data, offset, patchSize);
+				// Ran out of data before the integer was terminated, the caller will see the offset going past the end
+				if (Policy::checkReads && offset > patchSize) {
+					break;
+				}
+
 				ret += (byte & 0x7F) * shift;
 
 				// If the msb is set then the encoding ends on this byte
@@ -125,359 +404,5370 @@ namespace Hips {
 				ret += shift;
 			}
 
-			return T(ret);
+			return ret;
 		}
 
-		static u32 crc32(const u8* data, usize length, u32 crc = 0) {
-			// 8-bit CRC table
-			static constexpr u32 crcTable[] = {
-				0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E,
-				0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB,
-				0xF4D4B551, 0x83D385C7, 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8,
-				0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
-				0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59, 0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599,
-				0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
-				0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433, 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB,
-				0x086D3D2D, 0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-				0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65, 0x4DB26158, 0x3AB551CE, 0xA3BC0074,
-				0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5,
-				0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F, 0x5EDEF90E,
-				0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
-				0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27,
-				0x7D079EB1, 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0,
-				0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1,
-				0xA6BC5767, 0x3FB506DD, 0x48B2364B, 0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-				0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92,
-				0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D, 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
-				0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4,
-				0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777, 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-				0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D,
-				0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A,
-				0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37,
-				0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-			};
+		// Same as above, but integers that fit in 8 bytes are decoded from a single load, by finding the terminating byte
+		// (the first one with its msb set) and then packing the 7-bit groups before it together. Longer integers, and
+		// integers near the end of the patch where we can't load 8 bytes without going out of bounds, go byte-by-byte
+		template <typename T = u64, typename Policy = ReadPolicy::Checked>
+		inline T readRunLength(const u8* data, usize& offset, usize patchSize) {
+			if constexpr (std::endian::native == std::endian::little) {
+				if (offset <= patchSize && patchSize - offset >= 10) [[likely]] {
+					u64 word;
+					std::memcpy(&word, data + offset, sizeof(word));
+
+					const u64 terminators = word & 0x8080808080808080ull;
+					if (terminators != 0) [[likely]] {
+						const usize length = usize(std::countr_zero(terminators) / CHAR_BIT) + 1;
+						// Keep the low 7 bits of every byte up to and including the terminator
+						const u64 groups = word & (terminators ^ (terminators - 1)) & 0x7F7F7F7F7F7F7F7Full;
+#if defined(__BMI2__)
+						u64 value = _pext_u64(groups, 0x7F7F7F7F7F7F7F7Full);
+#else
+						u64 value = ((groups & 0x7F007F007F007F00ull) >> 1) | (groups & 0x007F007F007F007Full);
+						value = ((value & 0x3FFF00003FFF0000ull) >> 2) | (value & 0x00003FFF00003FFFull);
+						value = ((value & 0x0FFFFFFF00000000ull) >> 4) | (value & 0x000000000FFFFFFFull);
+#endif
 
-			crc = ~crc;
-			for (usize i = 0; i < length; i++) {
-				const u8 byte = data[i];
-				crc = crcTable[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+						offset += length;
+						return T(value + runLengthBias[length]);
+					}
+				}
 			}
 
-			return ~crc;
+			return T(readRunLengthBytewise<Policy>(data, offset, patchSize));
 		}
-	}  // namespace Detail
 
-	namespace IPS {
-		static constexpr usize headerSize = 5;
-		// Need at least 5 (header) + 3 (EOF) bytes to be a valid IPS patch
-		static constexpr usize minimumPatchSize = headerSize + 3;
-		// "EOF" magic string
-		static constexpr usize endOfFile = 0x454F46;
+		// Encodes an integer in the run-length format readRunLength decodes, for the patch creators
+		static void writeRunLength(std::vector<u8>& out, u64 value) {
+			while (true) {
+				const u8 group = value & 0x7F;
+				value >>= 7;
 
-		template <typename T = u64, usize size>
-		T read(const u8* data, usize& offset, usize patchSize) {
-			return Detail::readBE<T, size>(data, offset, patchSize);
+				if (value == 0) {
+					out.push_back(0x80 | group);
+					return;
+				}
+
+				out.push_back(group);
+				value--;
+			}
 		}
 
-		// The size isn't even encoded in the file properly, so we need to parse the file one time first to figure it out...
-		static usize getSize(const u8* patch, usize patchSize) {
-			usize outputSize = 0;
-			usize patchOffset = headerSize;  // Skip header bytes
+		static void writeLE32(std::vector<u8>& out, u32 value) {
+			for (int i = 0; i < 4; i++) {
+				out.push_back(u8(value >> (i * CHAR_BIT)));
+			}
+		}
 
-			while (patchOffset < patchSize) {
-				const usize fileOffset = read<usize, 3>(patch, patchOffset, patchSize);
+		// Features of the host CPU that our accelerated kernels care about, detected once at runtime
+		struct CpuFeatures {
+			bool pclmul = false;  // x86 carryless multiplication (PCLMULQDQ) + SSE4.1
+			bool avx2 = false;
+			bool pmull = false;  // ARMv8 polynomial multiplication (PMULL)
+		};
 
-				if (fileOffset == endOfFile) {
-					break;
+		static CpuFeatures detectCpuFeatures() {
+			CpuFeatures features;
+
+#if defined(HIPS_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+			int info[4];
+			__cpuid(info, 0);
+			const int maxLeaf = info[0];
+
+			__cpuid(info, 1);
+			const bool osxsave = (info[2] & (1 << 27)) != 0;
+			features.pclmul = (info[2] & (1 << 1)) != 0 && (info[2] & (1 << 19)) != 0;
+
+			if (maxLeaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+				__cpuidex(info, 7, 0);
+				features.avx2 = (info[1] & (1 << 5)) != 0;
+			}
+#else
+			__builtin_cpu_init();
+			features.pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+			features.avx2 = __builtin_cpu_supports("avx2");
+#endif
+#elif defined(HIPS_ARM_PMULL)
+#if defined(__linux__)
+			features.pmull = (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#else
+			// We were explicitly compiled for a target with the crypto extensions (eg Apple silicon)
+			features.pmull = true;
+#endif
+#endif
+
+			return features;
+		}
+
+		static const CpuFeatures& cpuFeatures() {
+			static const CpuFeatures features = detectCpuFeatures();
+			return features;
+		}
+
+		// CRC32 tables for slicing-by-16. crcTables[0] is the classic byte-at-a-time table, while crcTables[n] advances
+		// the CRC of a byte by n more zero bytes, letting us fold 16 bytes of input with 16 independent table lookups
+		static constexpr auto crcTables = []() {
+			std::array<std::array<u32, 256>, 16> tables{};
+
+			for (u32 i = 0; i < 256; i++) {
+				u32 crc = i;
+				for (int bit = 0; bit < 8; bit++) {
+					crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
 				}
 
-				usize newSize = fileOffset;
-				const u16 size = read<u16, 2>(patch, patchOffset, patchSize);
-				// RLE encoding
-				if (size == 0) {
-					const u16 rleSize = read<u16, 2>(patch, patchOffset, patchSize);
-					newSize += rleSize;
+				tables[0][i] = crc;
+			}
 
-					patchOffset += 1;  // Skip value field
-				} else {
-					patchOffset += size;  // Skip data field
-					newSize += size;
+			for (usize table = 1; table < tables.size(); table++) {
+				for (u32 i = 0; i < 256; i++) {
+					const u32 previous = tables[table - 1][i];
+					tables[table][i] = (previous >> 8) ^ tables[0][previous & 0xFF];
 				}
+			}
 
-				outputSize = std::max<usize>(outputSize, newSize);
+			return tables;
+		}();
+
+		static inline u32 load32LE(const u8* data) { return u32(data[0]) | (u32(data[1]) << 8) | (u32(data[2]) << 16) | (u32(data[3]) << 24); }
+
+		// The kernels below operate on the raw (pre-inverted) CRC register, crc32() handles the inversion
+		static u32 crc32Table(const u8* data, usize length, u32 crc) {
+			const auto& t = crcTables;
+
+			while (length >= 16) {
+				const u32 a = load32LE(data) ^ crc;
+				const u32 b = load32LE(data + 4);
+				const u32 c = load32LE(data + 8);
+				const u32 d = load32LE(data + 12);
+
+				crc = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^ t[12][a >> 24] ^ t[11][b & 0xFF] ^
+					  t[10][(b >> 8) & 0xFF] ^ t[9][(b >> 16) & 0xFF] ^ t[8][b >> 24] ^ t[7][c & 0xFF] ^ t[6][(c >> 8) & 0xFF] ^
+					  t[5][(c >> 16) & 0xFF] ^ t[4][c >> 24] ^ t[3][d & 0xFF] ^ t[2][(d >> 8) & 0xFF] ^ t[1][(d >> 16) & 0xFF] ^ t[0][d >> 24];
+
+				data += 16;
+				length -= 16;
 			}
 
-			if (patchOffset + 3 == patchSize) {
-				// Apparently some IPS files have a 3 byte footer with the ROM size after EOF
-				const usize actualSize = read<usize, 3>(patch, patchOffset, patchSize);
-				outputSize = std::max<usize>(outputSize, actualSize);
+			while (length-- > 0) {
+				crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
 			}
 
-			return outputSize;
+			return crc;
 		}
-	};  // namespace IPS
 
-	static std::pair<std::vector<u8>, Result> patchIPS(const u8* data, usize dataSize, const u8* patch, usize patchSize) {
-		if (patch == nullptr || patchSize < IPS::minimumPatchSize) [[unlikely]] {
-			return {{}, Result::InvalidPatch};
-		}
+		// Carryless multiplication folding, as described in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"
+		// We fold 4 128-bit lanes at a time, then fold those down to 1 lane, and finally Barrett reduce that to 32 bits.
+		// The constants are the bit-reflected x^n mod P(x) values from the paper. Requires length >= 64 and a multiple of 16.
+		static constexpr u64 crcFoldBy4[2] = {0x0154442BD4, 0x01C6E41596};
+		static constexpr u64 crcFoldBy1[2] = {0x01751997D0, 0x00CCAA009E};
+		static constexpr u64 crcFold64 = 0x0163CD6124;
+		static constexpr u64 crcBarrett[2] = {0x01DB710641, 0x01F7011641};
 
-		// Header magic does not match, so the patch is invalid
-		if (patch[0] != 'P' || patch[1] != 'A' || patch[2] != 'T' || patch[3] != 'C' || patch[4] != 'H') [[unlikely]] {
-			return {{}, Result::InvalidPatch};
+#if defined(HIPS_X86)
+		HIPS_TARGET("pclmul,sse4.1") static inline __m128i crcFold(__m128i acc, __m128i constants, __m128i next) {
+			const __m128i low = _mm_clmulepi64_si128(acc, constants, 0x00);
+			const __m128i high = _mm_clmulepi64_si128(acc, constants, 0x11);
+			return _mm_xor_si128(_mm_xor_si128(high, low), next);
 		}
 
-		// Copy file to be patched in output buffer
-		std::vector<u8> output(IPS::getSize(patch, patchSize));
-		std::memcpy(output.data(), data, std::min<u64>(output.size(), dataSize));
+		HIPS_TARGET("pclmul,sse4.1") static u32 crc32Clmul(const u8* data, usize length, u32 crc) {
+			const __m128i foldBy4 = _mm_set_epi64x(s64(crcFoldBy4[1]), s64(crcFoldBy4[0]));
+			const __m128i foldBy1 = _mm_set_epi64x(s64(crcFoldBy1[1]), s64(crcFoldBy1[0]));
 
-		// Skip header
-		usize offset = IPS::headerSize;
-		while (offset < patchSize) {
-			// Read the next record, starting from the 3-byte offset where the patch will be placed in the file to patch
-			const usize fileOffset = IPS::read<usize, 3>(patch, offset, patchSize);
-			if (fileOffset == IPS::endOfFile) {
-				// If we detect EOF, we are done applying the patch
-				break;
-			}
+			__m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+			__m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+			__m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+			__m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+			x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(int(crc)));
 
-			// Size of data to copy
-			u16 size = IPS::read<u16, 2>(patch, offset, patchSize);
-			if (size == 0) {
-				// RLE encoding
-				u16 rleSize = IPS::read<u16, 2>(patch, offset, patchSize);
-				u8 value = IPS::read<u8, 1>(patch, offset, patchSize);
+			data += 64;
+			length -= 64;
 
-				for (int i = 0; i < rleSize; i++) {
-					// Going out of ROM bounds
-					if (fileOffset + i >= output.size()) {
-						break;
-					}
+			// Fold 64 bytes at a time, keeping 4 independent dependency chains in flight
+			while (length >= 64) {
+				const __m128i x5 = _mm_clmulepi64_si128(x1, foldBy4, 0x00);
+				const __m128i x6 = _mm_clmulepi64_si128(x2, foldBy4, 0x00);
+				const __m128i x7 = _mm_clmulepi64_si128(x3, foldBy4, 0x00);
+				const __m128i x8 = _mm_clmulepi64_si128(x4, foldBy4, 0x00);
 
-					output[fileOffset + i] = value;
-				}
-			} else {
-				for (int i = 0; i < size; i++) {
-					// Going out of ROM bounds
-					if (fileOffset + i >= output.size()) {
-						break;
-					}
+				x1 = _mm_clmulepi64_si128(x1, foldBy4, 0x11);
+				x2 = _mm_clmulepi64_si128(x2, foldBy4, 0x11);
+				x3 = _mm_clmulepi64_si128(x3, foldBy4, 0x11);
+				x4 = _mm_clmulepi64_si128(x4, foldBy4, 0x11);
 
-					output[fileOffset + i] = IPS::read<u8, 1>(patch, offset, patchSize);
-				}
+				x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+				x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+				x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+				x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+
+				data += 64;
+				length -= 64;
 			}
-		}
 
-		return {output, Result::Success};
-	}
+			// Fold the 4 lanes into 1
+			x1 = crcFold(x1, foldBy1, x2);
+			x1 = crcFold(x1, foldBy1, x3);
+			x1 = crcFold(x1, foldBy1, x4);
 
-	namespace UPS {
-		static constexpr usize headerSize = 4;
-		// Need at least 4 (header) + 2 (minimum size for input/output sizes) + crc32s for input file, output file and patch
-		static constexpr usize minimumPatchSize = 18;
+			while (length >= 16) {
+				x1 = crcFold(x1, foldBy1, _mm_loadu_si128((const __m128i*)data));
+				data += 16;
+				length -= 16;
+			}
 
-		template <typename T = u64, usize size>
-		T read(const u8* data, usize& offset, usize patchSize) {
-			return Detail::readLE<T, size>(data, offset, patchSize);
+			// Fold 128 bits down to 64
+			const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+			x2 = _mm_clmulepi64_si128(x1, foldBy1, 0x10);
+			x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+			x2 = _mm_srli_si128(x1, 4);
+			x1 = _mm_and_si128(x1, mask32);
+			x1 = _mm_clmulepi64_si128(x1, _mm_set_epi64x(0, s64(crcFold64)), 0x00);
+			x1 = _mm_xor_si128(x1, x2);
+
+			// Barrett reduction down to 32 bits
+			const __m128i barrett = _mm_set_epi64x(s64(crcBarrett[1]), s64(crcBarrett[0]));
+			x2 = _mm_and_si128(x1, mask32);
+			x2 = _mm_clmulepi64_si128(x2, barrett, 0x10);
+			x2 = _mm_and_si128(x2, mask32);
+			x2 = _mm_clmulepi64_si128(x2, barrett, 0x00);
+			x1 = _mm_xor_si128(x1, x2);
+
+			return u32(_mm_extract_epi32(x1, 1));
+		}
+#elif defined(HIPS_ARM_PMULL)
+		// Same folding scheme as the x86 kernel, using PMULL/PMULL2 for the 64x64 -> 128-bit carryless multiplications
+		static inline uint64x2_t clmulLow(uint64x2_t a, uint64x2_t b) {
+			return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(a, 0), vgetq_lane_u64(b, 0)));
 		}
 
-		template <typename T = u64>
-		T readRunLength(const u8* data, usize& offset, usize patchSize) {
-			return Detail::readRunLength<T>(data, offset, patchSize);
+		static inline uint64x2_t clmulHigh(uint64x2_t a, uint64x2_t b) {
+			return vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(a, 1), vgetq_lane_u64(b, 1)));
 		}
-	}  // namespace UPS
 
-	static std::pair<std::vector<u8>, Result> patchUPS(const u8* data, usize dataSize, const u8* patch, usize patchSize) {
-		if (patch == nullptr || patchSize < IPS::minimumPatchSize) [[unlikely]] {
-			return {{}, Result::InvalidPatch};
+		static u32 crc32Clmul(const u8* data, usize length, u32 crc) {
+			const uint64x2_t foldBy4 = vld1q_u64(crcFoldBy4);
+			const uint64x2_t foldBy1 = vld1q_u64(crcFoldBy1);
+
+			uint64x2_t x1 = vld1q_u64((const u64*)(data + 0x00));
+			uint64x2_t x2 = vld1q_u64((const u64*)(data + 0x10));
+			uint64x2_t x3 = vld1q_u64((const u64*)(data + 0x20));
+			uint64x2_t x4 = vld1q_u64((const u64*)(data + 0x30));
+			x1 = veorq_u64(x1, vsetq_lane_u64(u64(crc), vdupq_n_u64(0), 0));
+
+			data += 64;
+			length -= 64;
+
+			const auto fold = [](uint64x2_t acc, uint64x2_t constants, uint64x2_t next) {
+				return veorq_u64(veorq_u64(clmulHigh(acc, constants), clmulLow(acc, constants)), next);
+			};
+
+			while (length >= 64) {
+				x1 = fold(x1, foldBy4, vld1q_u64((const u64*)(data + 0x00)));
+				x2 = fold(x2, foldBy4, vld1q_u64((const u64*)(data + 0x10)));
+				x3 = fold(x3, foldBy4, vld1q_u64((const u64*)(data + 0x20)));
+				x4 = fold(x4, foldBy4, vld1q_u64((const u64*)(data + 0x30)));
+
+				data += 64;
+				length -= 64;
+			}
+
+			x1 = fold(x1, foldBy1, x2);
+			x1 = fold(x1, foldBy1, x3);
+			x1 = fold(x1, foldBy1, x4);
+
+			while (length >= 16) {
+				x1 = fold(x1, foldBy1, vld1q_u64((const u64*)data));
+				data += 16;
+				length -= 16;
+			}
+
+			// Fold 128 bits down to 64
+			const uint64x2_t mask32 = vreinterpretq_u64_u32(uint32x4_t{~0u, 0, ~0u, 0});
+			uint64x2_t x = veorq_u64(vcombine_u64(vget_high_u64(x1), vdup_n_u64(0)), vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(x1, 0), crcFoldBy1[1])));
+
+			uint64x2_t shifted = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x), vdupq_n_u8(0), 4));
+			x = vandq_u64(x, mask32);
+			x = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(x, 0), crcFold64));
+			x = veorq_u64(x, shifted);
+
+			// Barrett reduction down to 32 bits
+			uint64x2_t t = vandq_u64(x, mask32);
+			t = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(t, 0), crcBarrett[1]));
+			t = vandq_u64(t, mask32);
+			t = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(t, 0), crcBarrett[0]));
+			x = veorq_u64(x, t);
+
+			return vgetq_lane_u32(vreinterpretq_u32_u64(x), 1);
 		}
+#endif
+
+		using Crc32Kernel = u32 (*)(const u8* data, usize length, u32 crc);
 
-		// Header magic does not match, so the patch is invalid
-		if (patch[0] != 'U' || patch[1] != 'P' || patch[2] != 'S' || patch[3] != '1') [[unlikely]] {
-			return {{}, Result::InvalidPatch};
+#if defined(HIPS_X86) || defined(HIPS_ARM_PMULL)
+		static u32 crc32Accelerated(const u8* data, usize length, u32 crc) {
+			// The folding kernel needs at least 4 full lanes to get going, anything else goes through the tables
+			if (length >= 64) {
+				const usize folded = length & ~usize(15);
+				crc = crc32Clmul(data, folded, crc);
+				data += folded;
+				length -= folded;
+			}
+
+			return crc32Table(data, length, crc);
 		}
+#endif
 
-		usize patchOffset = UPS::headerSize;
-		const u64 inputSize = UPS::readRunLength<u64>(patch, patchOffset, patchSize);
-		const u64 outputSize = UPS::readRunLength<u64>(patch, patchOffset, patchSize);
+		static Crc32Kernel selectCrc32Kernel() {
+#if defined(HIPS_X86)
+			if (cpuFeatures().pclmul) return crc32Accelerated;
+#elif defined(HIPS_ARM_PMULL)
+			if (cpuFeatures().pmull) return crc32Accelerated;
+#endif
+			return crc32Table;
+		}
 
-		// The file we're trying to patch is smaller than the input is meant to be, reject it
-		if (dataSize < inputSize) {
-			return {{}, Result::SizeMismatch};
+		static u32 crc32(const u8* data, usize length, u32 crc = 0) {
+			static const Crc32Kernel kernel = selectCrc32Kernel();
+			return ~kernel(data, length, ~crc);
 		}
 
-		std::vector<u8> output(outputSize);
-		usize sourceOffset = 0;
-		usize outputOffset = 0;
+		// CRC32s are remainders of polynomial division over GF(2), so the CRC32 of 2 pieces of data put together can be worked
+		// out from the CRC32 of each piece and the length of the second, by multiplying the first CRC32 by x^(8 * length) mod P(x)
+		// (the same way zlib's crc32_combine does it). Polynomials are bit-reflected like the CRC32 itself, so x^0 is the top bit
+		static constexpr u32 crcMultiply(u32 a, u32 b) {
+			u32 product = 0;
+			for (u32 bit = u32(1) << 31; bit != 0; bit >>= 1) {
+				if (a & bit) {
+					product ^= b;
+				}
+
+				b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : (b >> 1);
+			}
+
+			return product;
+		}
 
-		while (patchOffset < patchSize - 12) {
-			u64 length = UPS::readRunLength<u64>(patch, patchOffset, patchSize);
+		// crcPowers[n] = x^(2^n) mod P(x), enough for x^(8 * length) with any 64-bit length
+		static constexpr auto crcPowers = []() {
+			std::array<u32, 67> powers{};
+			powers[0] = u32(1) << 30;  // x^1
 
-			// Copy length bytes as-is
-			while (length > 0 && outputOffset < outputSize) {
-				output[outputOffset++] = UPS::read<u8, 1>(data, sourceOffset, dataSize);
-				length -= 1;
+			for (usize n = 1; n < powers.size(); n++) {
+				powers[n] = crcMultiply(powers[n - 1], powers[n - 1]);
 			}
 
-			while (outputOffset < outputSize) {
-				// Patch with XOR until we find the terminating patch value (0x00)
-				// Patching with XOR means patches are reversible, by simply applying the patch again
-				const u8 sourceValue = UPS::read<u8, 1>(data, sourceOffset, dataSize);
-				const u8 patchValue = UPS::read<u8, 1>(patch, patchOffset, patchSize);
-				output[outputOffset++] = sourceValue ^ patchValue;
+			return powers;
+		}();
 
-				// We need to check for this after applying the xor patch, otherwise the offset values will be wrong
-				if (patchValue == 0) {
-					break;
+		static constexpr u32 crc32Combine(u32 first, u32 second, u64 secondLength) {
+			// Build x^(8 * secondLength) out of the powers of 2 in its exponent. 8 = 2^3, so the lowest bit of the length is x^(2^3)
+			u32 shift = u32(1) << 31;  // x^0
+			for (usize n = 3; secondLength != 0; secondLength >>= 1, n++) {
+				if (secondLength & 1) {
+					shift = crcMultiply(crcPowers[n], shift);
 				}
 			}
+
+			return crcMultiply(shift, first) ^ second;
 		}
 
-		while (outputOffset < outputSize && sourceOffset < dataSize) {
-			// Copy the rest of the bytes
-			output[outputOffset++] = UPS::read<u8, 1>(data, sourceOffset, dataSize);
+		// Running CRC32 of a stream of data, so that the output of a patch can be checksummed while it's still in cache
+		class Crc32 {
+			u32 crc = 0;
+
+		  public:
+			void update(const u8* data, usize length) { crc = crc32(data, length, crc); }
+			u32 value() const { return crc; }
+		};
+
+		// UPS and BPS patches both end with the CRC32 of the input file, the output file and the patch itself (minus its own CRC)
+		struct Checksums {
+			u32 input;
+			u32 output;
+			u32 patch;
+		};
+
+		static Checksums readChecksums(const u8* patch, usize patchSize) {
+			usize offset = patchSize - 12;
+			const u32 input = readLE<u32, 4>(patch, offset, patchSize);
+			const u32 output = readLE<u32, 4>(patch, offset, patchSize);
+			const u32 patchCRC = readLE<u32, 4>(patch, offset, patchSize);
+
+			return {input, output, patchCRC};
 		}
 
-		// Pad rest of the output with 0s
-		while (outputOffset < outputSize) {
-			output[outputOffset++] = 0;
+		static bool verifyChecksums(const u8* data, usize inputSize, const u8* patch, usize patchSize, const Checksums& checksums) {
+			return crc32(patch, patchSize - 4) == checksums.patch && crc32(data, inputSize) == checksums.input;
 		}
 
-		const u32 inputCRC = UPS::read<u32, 4>(patch, patchOffset, patchSize);
-		const u32 outputCRC = UPS::read<u32, 4>(patch, patchOffset, patchSize);
-		const u32 patchCRC = UPS::read<u32, 4>(patch, patchOffset, patchSize);
+		// Same as readRunLength, but integers too large for 64 bits are reported instead of wrapping around. Integers of 8 bytes
+		// or less can't be, so only longer ones get decoded again with every step checked
+		static bool readRunLengthChecked(const u8* data, usize& offset, usize size, u64& value) {
+			const usize start = offset;
+			value = readRunLength<u64>(data, offset, size);
+			if (offset - start <= 8 || offset > size) {
+				return true;
+			}
 
-		if (outputCRC != Detail::crc32(output.data(), output.size())) {
-			return {output, Result::ChecksumMismatch};
-		}
+			constexpr u64 max = ~u64(0);
+			u64 result = 0;
+			u64 shift = 1;
 
-		return {output, Result::Success};
-	}
+			for (usize i = start;; i++) {
+				const u64 group = data[i] & 0x7F;
+				if (group > (max - result) / shift) {
+					return false;
+				}
 
-	namespace BPS {
-		static constexpr usize headerSize = 4;
-		// Need at least 5 (header) + 3 (source/target/metadata size) + 9 (checksums) bytes to be a valid BPS patch
-		static constexpr usize minimumPatchSize = headerSize + 3 + 9;
+				result += group * shift;
+				if (data[i] & 0x80) {
+					return true;
+				} else if (shift > (max >> 7) || result > max - (shift << 7)) {
+					return false;
+				}
 
-		template <typename T = u64, usize size>
-		T read(const u8* data, usize& offset, usize patchSize) {
-			return Detail::readLE<T, size>(data, offset, patchSize);
+				shift <<= 7;
+				result += shift;
+			}
 		}
 
-		template <typename T = u64>
-		T readRunLength(const u8* data, usize& offset, usize patchSize) {
-			return Detail::readRunLength<T>(data, offset, patchSize);
+		// Integers in patches being validated: strictly, the ones too large for 64 bits are reported, otherwise they wrap around
+		// the same way they do in the patchers
+		template <bool strict>
+		static bool readValidatedRunLength(const u8* data, usize& offset, usize size, u64& value) {
+			if constexpr (strict) {
+				return readRunLengthChecked(data, offset, size, value);
+			} else {
+				value = readRunLength<u64>(data, offset, size);
+				return true;
+			}
 		}
 
-		namespace Action {
-			enum : u32 {
-				SourceRead = 0,
-				TargetRead = 1,
-				SourceCopy = 2,
-				TargetCopy = 3,
-			};
-		}
-	}  // namespace BPS
+		static ValidationReport& failValidation(ValidationReport& report, PatchError error, usize offset) {
+			report.error = error;
+			report.errorOffset = offset;
 
-	static std::pair<std::vector<u8>, Result> patchBPS(const u8* data, usize dataSize, const u8* patch, usize patchSize) {
-		if (patch == nullptr || patchSize < BPS::minimumPatchSize) [[unlikely]] {
-			return {{}, Result::InvalidPatch};
-		}
+			switch (error) {
+				case PatchError::InputTooSmall: report.result = Result::SizeMismatch; break;
+				case PatchError::PatchChecksum: report.result = Result::ChecksumMismatch; break;
+				default: report.result = Result::InvalidPatch; break;
+			}
 
-		// Header magic does not match, so the patch is invalid
-		if (patch[0] != 'B' || patch[1] != 'P' || patch[2] != 'S' || patch[3] != '1') [[unlikely]] {
-			return {{}, Result::InvalidPatch};
+			return report;
 		}
 
-		usize patchOffset = BPS::headerSize;
-		const u64 inputSize = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
-		const u64 outputSize = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
-		const u64 metadataSize = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
+		// Reads the header and the checksums that UPS and BPS patches share for validate, returning where the header ends, or 0
+		// on errors
+		static usize readValidationHeader(
+			const u8* patch, usize patchSize, const char* magic, usize minimumPatchSize, bool strict, u64 inputSize, ValidationReport& report
+		) {
+			if (patch == nullptr || patchSize < minimumPatchSize || std::memcmp(patch, magic, 4) != 0) {
+				failValidation(report, PatchError::BadHeader, 0);
+				return 0;
+			}
 
-		// The file we're trying to patch is smaller than the input is meant to be, reject it
-		if (dataSize < inputSize) {
-			return {{}, Result::SizeMismatch};
+			usize offset = 4;
+			const bool inputFits = readRunLengthChecked(patch, offset, patchSize, report.inputSize);
+			const bool outputFits = readRunLengthChecked(patch, offset, patchSize, report.outputSize);
+			if (strict && !(inputFits && outputFits)) {
+				failValidation(report, PatchError::IntegerOverflow, 4);
+				return 0;
+			} else if (offset > patchSize - 12) {
+				failValidation(report, PatchError::Truncated, 4);
+				return 0;
+			}
+
+			const Checksums checksums = readChecksums(patch, patchSize);
+			report.checksummed = true;
+			report.inputCRC = checksums.input;
+			report.outputCRC = checksums.output;
+
+			// The patchers check the patch CRC themselves, so only strict validation needs another pass over the patch for it
+			if (strict && crc32(patch, patchSize - 4) != checksums.patch) {
+				failValidation(report, PatchError::PatchChecksum, patchSize - 4);
+				return 0;
+			} else if (inputSize < report.inputSize) {
+				failValidation(report, PatchError::InputTooSmall, 4);
+				return 0;
+			}
+
+			return offset;
 		}
 
-		// Copy file to be patched in output buffer
-		std::vector<u8> output(outputSize);
-		usize sourceOffset = 0;
-		usize outputOffset = 0;
-		usize outputOffset2 = 0; // Offset used for TargetCopy commands
+		// XOR kernels for UPS. These XOR source with patch into dest one block at a time, stopping before the first block that
+		// contains a 0 in the patch (which terminates an XOR run) or once there's less than a full block left.
+		// They return how many bytes they processed, leaving the end of the run to xorRun
+		using XorKernel = usize (*)(u8* dest, const u8* source, const u8* patch, usize length);
 
-		while (patchOffset < patchSize - 12) {
-			// Each "record" in a BPS patch consists of a VLE word, whose bottom 2 bits are a patching "action" to perform
-			// And the top bits are the length of memory to operate on
-			const u64 word = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
-			const u64 action = (word & 3);
-			u64 length = (word >> 2) + 1;
+#if defined(HIPS_X86)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HIPS_SSE2
+		static usize xorBlocksSSE2(u8* dest, const u8* source, const u8* patch, usize length) {
+			const __m128i zero = _mm_setzero_si128();
+			usize offset = 0;
 
-			switch (action) {
-				case BPS::Action::SourceRead: {
-					while (length > 0 && outputOffset < outputSize && outputOffset < dataSize) {
-						output[outputOffset] = data[outputOffset];
-						outputOffset += 1;
-						length -= 1;
-					}
+			for (; offset + 16 <= length; offset += 16) {
+				const __m128i patchBlock = _mm_loadu_si128((const __m128i*)(patch + offset));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi8(patchBlock, zero)) != 0) {
 					break;
 				}
 
-				case BPS::Action::TargetRead: {
-					while (length > 0 && outputOffset < outputSize) {
-						output[outputOffset++] = BPS::read<u8, 1>(patch, patchOffset, patchSize);
-						length -= 1;
-					}
-					break;
-				}
+				const __m128i sourceBlock = _mm_loadu_si128((const __m128i*)(source + offset));
+				_mm_storeu_si128((__m128i*)(dest + offset), _mm_xor_si128(sourceBlock, patchBlock));
+			}
 
-				case BPS::Action::SourceCopy: {
-					const u64 word = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
-					const s64 offset = s64(word >> 1);
-					sourceOffset += (word & 1) ? -offset : +offset;
+			return offset;
+		}
+#endif
 
-					while (length > 0) {
-						output[outputOffset++] = data[sourceOffset++];
-						length -= 1;
-					}
+		HIPS_TARGET("avx2") static usize xorBlocksAVX2(u8* dest, const u8* source, const u8* patch, usize length) {
+			const __m256i zero = _mm256_setzero_si256();
+			usize offset = 0;
+
+			for (; offset + 32 <= length; offset += 32) {
+				const __m256i patchBlock = _mm256_loadu_si256((const __m256i*)(patch + offset));
+				if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(patchBlock, zero)) != 0) {
 					break;
 				}
 
-				case BPS::Action::TargetCopy: {
-					const u64 data = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
-					const s64 offset = s64(data >> 1);
-					outputOffset2 += (data & 1) ? -offset : +offset;
+				const __m256i sourceBlock = _mm256_loadu_si256((const __m256i*)(source + offset));
+				_mm256_storeu_si256((__m256i*)(dest + offset), _mm256_xor_si256(sourceBlock, patchBlock));
+			}
 
-					while (length > 0) {
-						output[outputOffset++] = output[outputOffset2++];
-						length -= 1;
-					}
+			return offset;
+		}
+#endif
+
+		// Only picked on CPUs without SSE2, which every x86-64 one has, but always there so it can be tested against the others
+		static inline usize xorBlocksScalar(u8* dest, const u8* source, const u8* patch, usize length) {
+			constexpr u64 ones = 0x0101010101010101;
+			constexpr u64 highBits = 0x8080808080808080;
+			usize offset = 0;
+
+			for (; offset + sizeof(u64) <= length; offset += sizeof(u64)) {
+				u64 sourceWord, patchWord;
+				std::memcpy(&sourceWord, source + offset, sizeof(u64));
+				std::memcpy(&patchWord, patch + offset, sizeof(u64));
+
+				// Classic "does this word contain a zero byte" check
+				if (((patchWord - ones) & ~patchWord & highBits) != 0) {
 					break;
 				}
+
+				const u64 result = sourceWord ^ patchWord;
+				std::memcpy(dest + offset, &result, sizeof(u64));
 			}
+
+			return offset;
 		}
 
-		// Pad rest of the output with 0s
-		while (outputOffset < outputSize) {
-			output[outputOffset++] = 0;
+		static XorKernel selectXorKernel() {
+#if defined(HIPS_X86)
+			if (cpuFeatures().avx2) return xorBlocksAVX2;
+#endif
+#if defined(HIPS_SSE2)
+			return xorBlocksSSE2;
+#else
+			return xorBlocksScalar;
+#endif
 		}
 
-		const u32 inputCRC = BPS::read<u32, 4>(patch, patchOffset, patchSize);
-		const u32 outputCRC = BPS::read<u32, 4>(patch, patchOffset, patchSize);
-		const u32 patchCRC = BPS::read<u32, 4>(patch, patchOffset, patchSize);
+		// XOR source with patch into dest until we hit the 0 that terminates the XOR run in the patch (which is part of the run),
+		// or until we've written "length" bytes. Source and patch bytes past their end read as 0, and the offsets advance by
+		// the number of bytes in the run, which is returned
+		static usize xorRun(
+			u8* dest, usize length, const u8* source, usize& sourceOffset, usize sourceSize, const u8* patch, usize& patchOffset, usize patchSize
+		) {
+			static const XorKernel kernel = selectXorKernel();
+			const usize sourceAvailable = sourceOffset < sourceSize ? sourceSize - sourceOffset : 0;
+			const usize patchAvailable = patchOffset < patchSize ? patchSize - patchOffset : 0;
 
-		if (outputCRC != Detail::crc32(output.data(), output.size())) {
-			return {output, Result::ChecksumMismatch};
-		}
+			// Offsets can be past the end, in which case nothing gets read from there
+			const u8* sourceData = source + std::min(sourceOffset, sourceSize);
+			const u8* patchData = patch + std::min(patchOffset, patchSize);
+			usize count = kernel(dest, sourceData, patchData, std::min<usize>({length, sourceAvailable, patchAvailable}));
 
-		return {output, Result::Success};
-	}
+			// Past the end of the source, XORing just copies the patch up to the terminator
+			if (count == sourceAvailable && count < length && count < patchAvailable) {
+				const usize remaining = std::min<usize>(length, patchAvailable) - count;
+				const u8* terminator = (const u8*)std::memchr(patchData + count, 0, remaining);
+				const usize copied = terminator != nullptr ? usize(terminator - (patchData + count)) : remaining;
 
-	static std::pair<std::vector<u8>, Result> patch(const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type) {
-		switch (type) {
-			case PatchType::IPS: return patchIPS(data, dataSize, patch, patchSize);
-			case PatchType::UPS: return patchUPS(data, dataSize, patch, patchSize);
-			case PatchType::BPS: return patchBPS(data, dataSize, patch, patchSize);
-			default: return {{}, Result::UnknownFormat};  // Unknown patch format
+				std::memcpy(dest + count, patchData + count, copied);
+				count += copied;
+			}
+
+			// Finish the run a byte at a time, this handles the terminator itself and the end of the source or patch
+			while (count < length) {
+				const u8 sourceValue = count < sourceAvailable ? sourceData[count] : 0;
+				const u8 patchValue = count < patchAvailable ? patchData[count] : 0;
+				dest[count++] = sourceValue ^ patchValue;
+
+				if (patchValue == 0) {
+					break;
+				}
+			}
+
+			sourceOffset += count;
+			patchOffset += count;
+			return count;
 		}
+
+		// Compare kernels for the patch creators. They scan a and b for the first position where the bytes are different
+		// (findEqual = false) or the same (findEqual = true), returning "length" if there isn't one
+		using CompareKernel = usize (*)(const u8* a, const u8* b, usize length);
+
+		template <bool findEqual>
+		static usize compareScalar(const u8* a, const u8* b, usize length) {
+			constexpr u64 ones = 0x0101010101010101;
+			constexpr u64 highBits = 0x8080808080808080;
+			usize offset = 0;
+
+			for (; offset + sizeof(u64) <= length; offset += sizeof(u64)) {
+				u64 x, y;
+				std::memcpy(&x, a + offset, sizeof(u64));
+				std::memcpy(&y, b + offset, sizeof(u64));
+				const u64 difference = x ^ y;
+
+				// Equal bytes are the zero bytes of the XOR. The zero byte check can flag a byte above a real zero byte too,
+				// but never one below it, so the first flagged byte is right
+				const u64 found = findEqual ? ((difference - ones) & ~difference & highBits) : difference;
+				if (found != 0) {
+					if constexpr (std::endian::native == std::endian::little) {
+						return offset + usize(std::countr_zero(found) / CHAR_BIT);
+					} else {
+						break;  // Let the byte loop find it
+					}
+				}
+			}
+
+			while (offset < length && (a[offset] == b[offset]) != findEqual) {
+				offset++;
+			}
+
+			return offset;
+		}
+
+#if defined(HIPS_SSE2)
+		template <bool findEqual>
+		static usize compareSSE2(const u8* a, const u8* b, usize length) {
+			usize offset = 0;
+
+			for (; offset + 16 <= length; offset += 16) {
+				const __m128i x = _mm_loadu_si128((const __m128i*)(a + offset));
+				const __m128i y = _mm_loadu_si128((const __m128i*)(b + offset));
+				const u32 equal = u32(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+				const u32 found = findEqual ? equal : (~equal & 0xFFFF);
+
+				if (found != 0) {
+					return offset + usize(std::countr_zero(found));
+				}
+			}
+
+			return offset + compareScalar<findEqual>(a + offset, b + offset, length - offset);
+		}
+#endif
+
+#if defined(HIPS_X86)
+		// Goes through 64 bytes per iteration when looking for a difference, as that's the common case when diffing similar
+		// files and it keeps enough loads in flight to run at the speed of memory
+		template <bool findEqual>
+		HIPS_TARGET("avx2") static usize compareAVX2(const u8* a, const u8* b, usize length) {
+			usize offset = 0;
+
+			if constexpr (!findEqual) {
+				for (; offset + 64 <= length; offset += 64) {
+					const __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + offset));
+					const __m256i y0 = _mm256_loadu_si256((const __m256i*)(b + offset));
+					const __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + offset + 32));
+					const __m256i y1 = _mm256_loadu_si256((const __m256i*)(b + offset + 32));
+					const __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi8(x0, y0), _mm256_cmpeq_epi8(x1, y1));
+
+					if (_mm256_movemask_epi8(equal) != -1) {
+						break;  // The 32-byte loop below finds where
+					}
+				}
+			}
+
+			for (; offset + 32 <= length; offset += 32) {
+				const __m256i x = _mm256_loadu_si256((const __m256i*)(a + offset));
+				const __m256i y = _mm256_loadu_si256((const __m256i*)(b + offset));
+				const u32 equal = u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+				const u32 found = findEqual ? equal : ~equal;
+
+				if (found != 0) {
+					return offset + usize(std::countr_zero(found));
+				}
+			}
+
+			return offset + compareScalar<findEqual>(a + offset, b + offset, length - offset);
+		}
+#endif
+
+		template <bool findEqual>
+		static CompareKernel selectCompareKernel() {
+#if defined(HIPS_X86)
+			if (cpuFeatures().avx2) return compareAVX2<findEqual>;
+#endif
+#if defined(HIPS_SSE2)
+			return compareSSE2<findEqual>;
+#else
+			return compareScalar<findEqual>;
+#endif
+		}
+
+		// How many bytes a and b have in common from the start, up to "length"
+		static usize matchLength(const u8* a, const u8* b, usize length) {
+			static const CompareKernel kernel = selectCompareKernel<false>();
+			return kernel(a, b, length);
+		}
+
+		// How many bytes are different in a and b from the start, up to "length"
+		static usize differenceLength(const u8* a, const u8* b, usize length) {
+			static const CompareKernel kernel = selectCompareKernel<true>();
+			return kernel(a, b, length);
+		}
+	}  // namespace Detail
+
+	namespace IPS {
+		static constexpr usize headerSize = 5;
+		// Need at least 5 (header) + 3 (EOF) bytes to be a valid IPS patch
+		static constexpr usize minimumPatchSize = headerSize + 3;
+		// "EOF" magic string
+		static constexpr usize endOfFile = 0x454F46;
+
+		template <typename T = u64, usize size, typename Policy = ReadPolicy::Checked>
+		T read(const u8* data, usize& offset, usize patchSize) {
+			return Detail::readBE<T, size, Policy>(data, offset, patchSize);
+		}
+
+		// Walks the records of a patch without applying them, checking that the header is correct and that no record goes past
+		// the end of the patch. Patches that pass this can be applied with ReadPolicy::Trusted. Strict validation also rejects
+		// patches the patchers put up with, that end without "EOF" or have something other than a 3 byte size after it
+		template <bool strict = false>
+		static ValidationReport validate(const u8* patch, usize patchSize) {
+			ValidationReport report;
+			if (patch == nullptr || patchSize < minimumPatchSize || std::memcmp(patch, "PATCH", 5) != 0) [[unlikely]] {
+				return Detail::failValidation(report, PatchError::BadHeader, 0);
+			}
+
+			usize offset = headerSize;
+			bool foundEndOfFile = false;
+
+			while (offset < patchSize) {
+				const usize recordStart = offset;
+				if (patchSize - offset < 3) {
+					return Detail::failValidation(report, PatchError::Truncated, recordStart);
+				}
+
+				const usize fileOffset = read<usize, 3>(patch, offset, patchSize);
+				if (fileOffset == endOfFile) {
+					foundEndOfFile = true;
+					break;
+				}
+
+				if (patchSize - offset < 2) {
+					return Detail::failValidation(report, PatchError::Truncated, recordStart);
+				}
+
+				// The size is followed by the data, or by the RLE size and value if it's 0
+				const u16 size = read<u16, 2>(patch, offset, patchSize);
+				const usize body = size != 0 ? size : 3;
+				if (patchSize - offset < body) {
+					return Detail::failValidation(report, PatchError::Truncated, recordStart);
+				}
+
+				const u16 length = size != 0 ? size : read<u16, 2>(patch, offset, patchSize);
+				offset = recordStart + 5 + body;
+				report.outputSize = std::max<u64>(report.outputSize, fileOffset + length);
+				report.operationCount++;
+			}
+
+			if (!foundEndOfFile) {
+				return strict ? Detail::failValidation(report, PatchError::MissingEndOfFile, patchSize) : report;
+			}
+
+			// Some IPS patches store the size of the output after EOF, anything else there is something else entirely
+			if (patchSize - offset == 3) {
+				report.outputSize = std::max<u64>(report.outputSize, read<usize, 3>(patch, offset, patchSize));
+			} else if (strict && offset != patchSize) {
+				return Detail::failValidation(report, PatchError::TrailingData, offset);
+			}
+
+			return report;
+		}
+
+		// The size isn't even encoded in the file properly, so we need to parse the file one time first to figure it out...
+		template <typename Policy = ReadPolicy::Checked>
+		static usize getSize(const u8* patch, usize patchSize) {
+			usize outputSize = 0;
+			usize patchOffset = headerSize;  // Skip header bytes
+
+			while (patchOffset < patchSize) {
+				const usize fileOffset = read<usize, 3, Policy>(patch, patchOffset, patchSize);
+
+				if (fileOffset == endOfFile) {
+					break;
+				}
+
+				usize newSize = fileOffset;
+				const u16 size = read<u16, 2, Policy>(patch, patchOffset, patchSize);
+				// RLE encoding
+				if (size == 0) {
+					const u16 rleSize = read<u16, 2, Policy>(patch, patchOffset, patchSize);
+					newSize += rleSize;
+
+					patchOffset += 1;  // Skip value field
+				} else {
+					patchOffset += size;  // Skip data field
+					newSize += size;
+				}
+
+				outputSize = std::max<usize>(outputSize, newSize);
+			}
+
+			if (patchOffset + 3 == patchSize) {
+				// Apparently some IPS files have a 3 byte footer with the ROM size after EOF
+				const usize actualSize = read<usize, 3, Policy>(patch, patchOffset, patchSize);
+				outputSize = std::max<usize>(outputSize, actualSize);
+			}
+
+			return outputSize;
+		}
+
+		// Checks the header of a patch, and the rest of it too if the policy validates patches before applying them
+		template <typename Policy = ReadPolicy::Checked>
+		static Result checkPatch(const u8* patch, usize patchSize) {
+			if (patch == nullptr || patchSize < minimumPatchSize) [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			// Header magic does not match, so the patch is invalid
+			if (patch[0] != 'P' || patch[1] != 'A' || patch[2] != 'T' || patch[3] != 'C' || patch[4] != 'H') [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			if constexpr (Policy::validateFirst) {
+				return validate(patch, patchSize).result;
+			}
+
+			return Result::Success;
+		}
+
+		// Applies a patch that passed checkPatch to an output buffer of getSize() bytes, writing every byte of it
+		template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+		static Result apply(
+			u8* output, usize outputSize, const u8* data, usize dataSize, const u8* patch, usize patchSize, Observer& observer = Detail::nullObserver
+		) {
+			Detail::PhaseClock<Observer> clock(observer);
+
+			// Copy file to be patched in output buffer, padding it with 0s if it's smaller than the patched file
+			const usize copySize = std::min<usize>(outputSize, dataSize);
+			if (copySize != 0) {
+				std::memcpy(output, data, copySize);
+			}
+
+			if (outputSize > copySize) {
+				std::memset(output + copySize, 0, outputSize - copySize);
+			}
+
+			clock.charge(PatchPhase::Copy);
+
+			// Skip header
+			usize offset = headerSize;
+			while (offset < patchSize) {
+				const usize recordStart = offset;
+
+				// Read the next record, starting from the 3-byte offset where the patch will be placed in the file to patch
+				const usize fileOffset = read<usize, 3, Policy>(patch, offset, patchSize);
+				if (fileOffset == endOfFile) {
+					// If we detect EOF, we are done applying the patch
+					break;
+				}
+
+				// Size of data to copy
+				const u16 size = read<u16, 2, Policy>(patch, offset, patchSize);
+				// Records get clamped to the ROM bounds once, anything going out of them is dropped
+				const usize recordOffset = std::min<usize>(fileOffset, outputSize);
+				const usize room = outputSize - recordOffset;
+
+				if (size == 0) {
+					// RLE encoding
+					const u16 rleSize = read<u16, 2, Policy>(patch, offset, patchSize);
+					const u8 value = read<u8, 1, Policy>(patch, offset, patchSize);
+					clock.charge(PatchPhase::Decode);
+
+					std::memset(output + recordOffset, value, std::min<usize>(rleSize, room));
+					observer.event(PatchEvent::IPSRunLength, std::min<usize>(rleSize, room));
+				} else {
+					clock.charge(PatchPhase::Decode);
+
+					// Only the data that actually got copied is skipped
+					Detail::readBytes(output + recordOffset, patch, offset, patchSize, std::min<usize>(size, room));
+					observer.event(PatchEvent::IPSRecord, std::min<usize>(size, room));
+				}
+
+				clock.charge(PatchPhase::Copy);
+
+				// The record was cut short by the end of the patch
+				if (Policy::checkReads && offset > patchSize) {
+					observer.error(Result::InvalidPatch, recordStart);
+					return Result::InvalidPatch;
+				}
+			}
+
+			return Result::Success;
+		}
+	};  // namespace IPS
+
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>, typename Observer = NullObserver>
+	static std::pair<std::vector<u8, Allocator>, Result> patchIPS(
+		const u8* data, usize dataSize, const u8* patch, usize patchSize, Observer& observer = Detail::nullObserver
+	) {
+		if (const Result result = IPS::checkPatch<Policy>(patch, patchSize); result != Result::Success) {
+			observer.error(result, 0);
+			return {{}, result};
+		}
+
+		std::vector<u8, Allocator> output(IPS::getSize<Policy>(patch, patchSize));
+		observer.allocated(output.size());
+
+		if (const Result result = IPS::apply<Policy>(output.data(), output.size(), data, dataSize, patch, patchSize, observer);
+			result != Result::Success) {
+			return {{}, result};
+		}
+
+		return {std::move(output), Result::Success};
+	}
+
+	// Same as above, but the patched file is written into "output" instead of a new vector. It has to have room for at least
+	// as many bytes as queryOutputSize returns, otherwise SizeMismatch is returned. Only that many bytes are written
+	template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+	static Result patchIPSInto(
+		std::span<u8> output, const u8* data, usize dataSize, const u8* patch, usize patchSize, Observer& observer = Detail::nullObserver
+	) {
+		if (const Result result = IPS::checkPatch<Policy>(patch, patchSize); result != Result::Success) {
+			observer.error(result, 0);
+			return result;
+		}
+
+		const usize outputSize = IPS::getSize<Policy>(patch, patchSize);
+		if (output.size() < outputSize) {
+			observer.error(Result::SizeMismatch, 0);
+			return Result::SizeMismatch;
+		}
+
+		return IPS::apply<Policy>(output.data(), outputSize, data, dataSize, patch, patchSize, observer);
+	}
+
+	// Applies an IPS patch directly on top of "dataSize" bytes of data, in a caller-owned buffer with room for "capacity" bytes.
+	// The buffer only grows when a record or the size footer reaches past the end of the data, with the new space zero-filled.
+	// Unlike patchIPS, which ends the file at the last record, patches without a size footer keep the size
+	// of the data (or the end of the last record if that's further), as most other IPS tools do. Patches with one get the
+	// size in it, unless a record goes further.
+	// Returns the size of the patched file. If that doesn't fit in "capacity", records that don't fit are skipped and SizeMismatch
+	// is returned along with the capacity needed. IPS records don't depend on the data they overwrite, so applying the patch again
+	// on the same data (with the original dataSize) and a big enough buffer gives the exact same result as applying it once
+	// With ReadPolicy::Checked, a record cut short by the end of the patch stops patching with InvalidPatch, after the records before it
+	// have already been applied. Use ReadPolicy::Validated to reject such patches before touching the data instead
+	template <typename Policy = ReadPolicy::Checked>
+	static std::pair<usize, Result> patchIPSInPlace(u8* data, usize dataSize, usize capacity, const u8* patch, usize patchSize) {
+		if (const Result result = IPS::checkPatch<Policy>(patch, patchSize); result != Result::Success) {
+			return {dataSize, result};
+		}
+
+		usize size = dataSize;      // Current size of the patched data
+		usize requiredSize = size;  // Capacity needed to apply every record
+		usize patchedSize = 0;      // Furthest point written by a record
+
+		// Grow the data up to "end" if the buffer can fit it, zero-filling the new bytes. Returns whether [0, end) is writable
+		const auto grow = [&](usize end) {
+			requiredSize = std::max<usize>(requiredSize, end);
+			if (end > capacity) {
+				return false;
+			}
+
+			if (end > size) {
+				std::memset(data + size, 0, end - size);
+				size = end;
+			}
+
+			return true;
+		};
+
+		// Skip header
+		usize offset = IPS::headerSize;
+		while (offset < patchSize) {
+			const usize fileOffset = IPS::read<usize, 3, Policy>(patch, offset, patchSize);
+			if (fileOffset == IPS::endOfFile) {
+				break;
+			}
+
+			const u16 recordSize = IPS::read<u16, 2, Policy>(patch, offset, patchSize);
+			if (recordSize == 0) {
+				// RLE encoding
+				const u16 rleSize = IPS::read<u16, 2, Policy>(patch, offset, patchSize);
+				const u8 value = IPS::read<u8, 1, Policy>(patch, offset, patchSize);
+
+				patchedSize = std::max<usize>(patchedSize, fileOffset + rleSize);
+				if (grow(fileOffset + rleSize)) {
+					std::memset(data + fileOffset, value, rleSize);
+				}
+			} else {
+				patchedSize = std::max<usize>(patchedSize, fileOffset + recordSize);
+				if (grow(fileOffset + recordSize)) {
+					Detail::readBytes(data + fileOffset, patch, offset, patchSize, recordSize);
+				} else {
+					offset += recordSize;  // Skip data field
+				}
+			}
+
+			if (Policy::checkReads && offset > patchSize) {
+				return {size, Result::InvalidPatch};
+			}
+		}
+
+		// The optional footer after EOF holds the size of the patched file, which can truncate or extend the data, but never
+		// cuts off anything a record wrote. Without it the data keeps its size
+		if (offset + 3 == patchSize) {
+			const usize footerSize = IPS::read<usize, 3, Policy>(patch, offset, patchSize);
+			grow(footerSize);
+			size = std::max<usize>(patchedSize, footerSize);
+		}
+
+		if (requiredSize > capacity) {
+			return {requiredSize, Result::SizeMismatch};
+		}
+
+		return {size, Result::Success};
+	}
+
+	// Same as above, for patching a vector in-place. The vector is only resized if the patch grows it or its size footer
+	// truncates it, so its size can differ from what patchIPS gives for patches without a footer
+	template <typename Policy = ReadPolicy::Checked>
+	static Result patchIPSInPlace(std::vector<u8>& data, const u8* patch, usize patchSize) {
+		const usize dataSize = data.size();
+		auto [size, result] = patchIPSInPlace<Policy>(data.data(), dataSize, data.size(), patch, patchSize);
+
+		if (result == Result::SizeMismatch) {
+			// Make room for the records that didn't fit and apply the patch again. It's already been validated if it had to be
+			using RetryPolicy = std::conditional_t<Policy::validateFirst, ReadPolicy::Trusted, Policy>;
+			data.resize(size);
+			std::tie(size, result) = patchIPSInPlace<RetryPolicy>(data.data(), dataSize, data.size(), patch, patchSize);
+		}
+
+		if (result == Result::Success) {
+			data.resize(size);
+		}
+
+		return result;
+	}
+
+	namespace UPS {
+		static constexpr usize headerSize = 4;
+		// Need at least 4 (header) + 2 (minimum size for input/output sizes) + crc32s for input file, output file and patch
+		static constexpr usize minimumPatchSize = 18;
+
+		template <typename T = u64, usize size, typename Policy = ReadPolicy::Checked>
+		T read(const u8* data, usize& offset, usize patchSize) {
+			return Detail::readLE<T, size, Policy>(data, offset, patchSize);
+		}
+
+		template <typename T = u64, typename Policy = ReadPolicy::Checked>
+		T readRunLength(const u8* data, usize& offset, usize patchSize) {
+			return Detail::readRunLength<T, Policy>(data, offset, patchSize);
+		}
+
+		// Walks the hunks of a patch without applying them, checking that the header is correct and that nothing goes past
+		// the end of the patch. Patches that pass this can be applied with ReadPolicy::Trusted. Strict validation also checks
+		// the patch CRC and that every integer fits in 64 bits, and rejects runs going into the checksums at the end (which
+		// the patchers read as part of the run), and with "inputSize", that the input is as large as the header says
+		template <bool strict = false>
+		static ValidationReport validate(const u8* patch, usize patchSize, u64 inputSize = ~u64(0)) {
+			ValidationReport report;
+			usize offset = Detail::readValidationHeader(patch, patchSize, "UPS1", minimumPatchSize, strict, inputSize, report);
+			if (offset == 0) {
+				return report;
+			}
+
+			// Same walk as the patchers, which stop once the output is full. The 0 ending the last run is usually left over then
+			const usize footer = patchSize - 12;
+			const usize end = strict ? footer : patchSize;
+			u64 outputOffset = 0;
+
+			while (offset < footer && outputOffset < report.outputSize) {
+				const usize hunkStart = offset;
+				u64 length;
+				if (!Detail::readValidatedRunLength<strict>(patch, offset, end, length)) {
+					return Detail::failValidation(report, PatchError::IntegerOverflow, hunkStart);
+				} else if (offset > end) {
+					return Detail::failValidation(report, PatchError::Truncated, hunkStart);
+				}
+
+				outputOffset += std::min<u64>(length, report.outputSize - outputOffset);
+				const u64 remaining = report.outputSize - outputOffset;
+				const usize available = end - offset;
+				const u8* terminator = (const u8*)std::memchr(patch + offset, 0, usize(std::min<u64>(remaining, available)));
+
+				if (terminator != nullptr) {
+					const usize runLength = usize(terminator - (patch + offset)) + 1;
+					offset += runLength;
+					outputOffset += runLength;
+				} else if (remaining <= available) {
+					offset += usize(remaining);
+					outputOffset = report.outputSize;
+				} else {
+					return Detail::failValidation(report, PatchError::Truncated, hunkStart);
+				}
+
+				report.operationCount++;
+			}
+
+			return report;
+		}
+
+		struct Header {
+			u64 inputSize;
+			u64 outputSize;
+			usize hunksOffset;  // Where the hunks start in the patch
+		};
+
+		// Checks the header of a patch (and the rest of it too if the policy validates patches before applying them) and reads it
+		template <typename Policy = ReadPolicy::Checked>
+		static Result readHeader(const u8* patch, usize patchSize, Header& header) {
+			if (patch == nullptr || patchSize < minimumPatchSize) [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			// Header magic does not match, so the patch is invalid
+			if (patch[0] != 'U' || patch[1] != 'P' || patch[2] != 'S' || patch[3] != '1') [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			if constexpr (Policy::validateFirst) {
+				if (validate(patch, patchSize).result != Result::Success) {
+					return Result::InvalidPatch;
+				}
+			}
+
+			usize patchOffset = headerSize;
+			header.inputSize = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+			header.outputSize = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+			header.hunksOffset = patchOffset;
+
+			if (Policy::checkReads && patchOffset > patchSize) {
+				return Result::InvalidPatch;
+			}
+
+			return Result::Success;
+		}
+
+		// Applies a patch to an output buffer of header.outputSize bytes, writing every byte of it. A checksum mismatch can be
+		// found either before the output is written (input or patch) or after, so "outputWritten" says whether it got that far
+		template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+		static Result apply(
+			u8* output, const Header& header, const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification,
+			bool& outputWritten, Observer& observer = Detail::nullObserver
+		) {
+			const u64 inputSize = header.inputSize;
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.hunksOffset;
+			outputWritten = false;
+			Detail::PhaseClock<Observer> clock(observer);
+
+			// The file we're trying to patch is smaller than the input is meant to be, reject it
+			if (dataSize < inputSize) {
+				observer.error(Result::SizeMismatch, headerSize);
+				return Result::SizeMismatch;
+			}
+
+			const Detail::Checksums checksums = Detail::readChecksums(patch, patchSize);
+			std::future<bool> inputsValid;
+
+			if (verification == Verification::Eager) {
+				if (!Detail::verifyChecksums(data, inputSize, patch, patchSize, checksums)) {
+					observer.error(Result::ChecksumMismatch, patchSize - 12);
+					return Result::ChecksumMismatch;
+				}
+			} else {
+				inputsValid = std::async(std::launch::async, Detail::verifyChecksums, data, inputSize, patch, patchSize, checksums);
+			}
+
+			clock.charge(PatchPhase::Checksum);
+
+			Detail::Crc32 outputCRC;
+			usize sourceOffset = 0;
+			usize outputOffset = 0;
+
+			// Once the output is full, the rest of the patch can't change anything
+			while (patchOffset < patchSize - 12 && outputOffset < outputSize) {
+				const usize hunkStart = patchOffset;
+				const usize runStart = outputOffset;
+				const u64 length = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+				clock.charge(PatchPhase::Decode);
+
+				// Copy length bytes as-is
+				const usize copyLength = std::min<usize>(length, outputSize - outputOffset);
+				Detail::readBytes(output + outputOffset, data, sourceOffset, dataSize, copyLength);
+				outputOffset += copyLength;
+				observer.event(PatchEvent::UPSCopy, copyLength);
+
+				// Patch with XOR until we find the terminating patch value (0x00)
+				// Patching with XOR means patches are reversible, by simply applying the patch again
+				const usize xorLength = Detail::xorRun(
+					output + outputOffset, outputSize - outputOffset, data, sourceOffset, dataSize, patch, patchOffset, patchSize
+				);
+				outputOffset += xorLength;
+				observer.event(PatchEvent::UPSXor, xorLength);
+				clock.charge(PatchPhase::Copy);
+
+				outputCRC.update(output + runStart, outputOffset - runStart);
+				clock.charge(PatchPhase::Checksum);
+
+				// The hunk was cut short by the end of the patch
+				if (Policy::checkReads && patchOffset > patchSize) {
+					observer.error(Result::InvalidPatch, hunkStart);
+					return Result::InvalidPatch;
+				}
+			}
+
+			// Copy the rest of the bytes, padding the output with 0s if the input is smaller than it
+			const usize tailStart = outputOffset;
+			Detail::readBytes(output + tailStart, data, sourceOffset, dataSize, outputSize - tailStart);
+			if (outputSize > tailStart) {
+				observer.event(PatchEvent::UPSCopy, outputSize - tailStart);
+			}
+
+			clock.charge(PatchPhase::Copy);
+			outputCRC.update(output + tailStart, outputSize - tailStart);
+
+			const bool inputsMatch = !inputsValid.valid() || inputsValid.get();
+			clock.charge(PatchPhase::Checksum);
+
+			if (!inputsMatch) {
+				observer.error(Result::ChecksumMismatch, patchSize - 12);
+				return Result::ChecksumMismatch;
+			}
+
+			outputWritten = true;
+			if (outputCRC.value() != checksums.output) {
+				observer.error(Result::ChecksumMismatch, patchSize - 8);
+				return Result::ChecksumMismatch;
+			}
+
+			return Result::Success;
+		}
+	}  // namespace UPS
+
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>, typename Observer = NullObserver>
+	static std::pair<std::vector<u8, Allocator>, Result> patchUPS(
+		const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification = Verification::Eager,
+		Observer& observer = Detail::nullObserver
+	) {
+		UPS::Header header;
+		if (const Result result = UPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+			observer.error(result, 0);
+			return {{}, result};
+		}
+
+		std::vector<u8, Allocator> output(header.outputSize);
+		observer.allocated(output.size());
+
+		bool outputWritten;
+		const Result result =
+			UPS::apply<Policy>(output.data(), header, data, dataSize, patch, patchSize, verification, outputWritten, observer);
+
+		// If the output's checksum doesn't match, it's still returned for the caller to inspect
+		if (!outputWritten) {
+			return {{}, result};
+		}
+
+		return {std::move(output), result};
+	}
+
+	// Same as above, but the patched file is written into "output" instead of a new vector. It has to have room for at least
+	// as many bytes as queryOutputSize returns, otherwise SizeMismatch is returned. Only that many bytes are written
+	template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+	static Result patchUPSInto(
+		std::span<u8> output, const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification = Verification::Eager,
+		Observer& observer = Detail::nullObserver
+	) {
+		UPS::Header header;
+		if (const Result result = UPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+			observer.error(result, 0);
+			return result;
+		}
+
+		if (output.size() < header.outputSize) {
+			observer.error(Result::SizeMismatch, 0);
+			return Result::SizeMismatch;
+		}
+
+		bool outputWritten;
+		return UPS::apply<Policy>(output.data(), header, data, dataSize, patch, patchSize, verification, outputWritten, observer);
+	}
+
+	namespace BPS {
+		static constexpr usize headerSize = 4;
+		// Need at least 5 (header) + 3 (source/target/metadata size) + 9 (checksums) bytes to be a valid BPS patch
+		static constexpr usize minimumPatchSize = headerSize + 3 + 9;
+
+		template <typename T = u64, usize size, typename Policy = ReadPolicy::Checked>
+		T read(const u8* data, usize& offset, usize patchSize) {
+			return Detail::readLE<T, size, Policy>(data, offset, patchSize);
+		}
+
+		template <typename T = u64, typename Policy = ReadPolicy::Checked>
+		T readRunLength(const u8* data, usize& offset, usize patchSize) {
+			return Detail::readRunLength<T, Policy>(data, offset, patchSize);
+		}
+
+		namespace Action {
+			enum : u32 {
+				SourceRead = 0,
+				TargetRead = 1,
+				SourceCopy = 2,
+				TargetCopy = 3,
+			};
+		}
+
+		// Walks the actions of a patch without applying them, checking that the header is correct, that nothing goes past
+		// the end of the patch and that no action writes past the end of the output. Patches that pass this can be applied
+		// with ReadPolicy::Trusted. Strict validation also checks the patch CRC, that every integer fits in 64 bits, that
+		// reads and copies stay inside what they read from and that the actions fill the output, and rejects TargetReads going
+		// into the checksums at the end. With "inputSize", it checks that the input is as large as the header says too
+		template <bool strict = false>
+		static ValidationReport validate(const u8* patch, usize patchSize, u64 inputSize = ~u64(0)) {
+			ValidationReport report;
+			usize offset = Detail::readValidationHeader(patch, patchSize, "BPS1", minimumPatchSize, strict, inputSize, report);
+			if (offset == 0) {
+				return report;
+			}
+
+			const usize footer = patchSize - 12;
+			const usize end = strict ? footer : patchSize;
+			u64 metadataSize;
+			if (!Detail::readValidatedRunLength<strict>(patch, offset, end, metadataSize)) {
+				return Detail::failValidation(report, PatchError::IntegerOverflow, 4);
+			} else if (offset > footer || metadataSize > footer - offset) {
+				return Detail::failValidation(report, PatchError::Truncated, 4);
+			}
+
+			offset += usize(metadataSize);
+			const u64 outputSize = report.outputSize;
+			u64 outputOffset = 0;
+			u64 sourceOffset = 0;
+			u64 targetOffset = 0;
+
+			while (offset < footer) {
+				const usize actionStart = offset;
+				u64 word;
+				if (!Detail::readValidatedRunLength<strict>(patch, offset, end, word)) {
+					return Detail::failValidation(report, PatchError::IntegerOverflow, actionStart);
+				} else if (offset > end) {
+					return Detail::failValidation(report, PatchError::Truncated, actionStart);
+				}
+
+				const u64 length = (word >> 2) + 1;
+				if (length > outputSize - outputOffset) {
+					return Detail::failValidation(report, PatchError::WritePastOutput, actionStart);
+				}
+
+				switch (word & 3) {
+					case Action::SourceRead:
+						if (strict && (outputOffset > report.inputSize || length > report.inputSize - outputOffset)) {
+							return Detail::failValidation(report, PatchError::SourceOutOfRange, actionStart);
+						}
+						break;
+
+					case Action::TargetRead:
+						if (length > end - offset) {
+							return Detail::failValidation(report, PatchError::Truncated, actionStart);
+						}
+
+						offset += usize(length);
+						break;
+
+					// The offsets of copies are relative to where the last copy of the same kind ended
+					case Action::SourceCopy:
+					case Action::TargetCopy: {
+						u64 relative;
+						if (!Detail::readValidatedRunLength<strict>(patch, offset, end, relative)) {
+							return Detail::failValidation(report, PatchError::IntegerOverflow, actionStart);
+						} else if (offset > end) {
+							return Detail::failValidation(report, PatchError::Truncated, actionStart);
+						}
+
+						const bool source = (word & 3) == Action::SourceCopy;
+						u64& copyOffset = source ? sourceOffset : targetOffset;
+						const u64 distance = relative >> 1;
+						const u64 limit = source ? report.inputSize : outputOffset;
+
+						// Going before the start wraps around, which lands past the limit
+						copyOffset = (relative & 1) ? copyOffset - distance : copyOffset + distance;
+						if (strict && (copyOffset >= limit || (source && length > limit - copyOffset))) {
+							return Detail::failValidation(report, source ? PatchError::SourceOutOfRange : PatchError::TargetOutOfRange, actionStart);
+						}
+
+						copyOffset += length;
+						break;
+					}
+				}
+
+				outputOffset += length;
+				report.operationCount++;
+			}
+
+			if (strict && outputOffset != outputSize) {
+				return Detail::failValidation(report, PatchError::OutputNotFilled, footer);
+			}
+
+			return report;
+		}
+
+		struct Header {
+			u64 inputSize;
+			u64 outputSize;
+			usize actionsOffset;  // Where the actions start in the patch, after the metadata
+		};
+
+		// Checks the header of a patch (and the rest of it too if the policy validates patches before applying them) and reads it
+		template <typename Policy = ReadPolicy::Checked>
+		static Result readHeader(const u8* patch, usize patchSize, Header& header) {
+			if (patch == nullptr || patchSize < minimumPatchSize) [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			// Header magic does not match, so the patch is invalid
+			if (patch[0] != 'B' || patch[1] != 'P' || patch[2] != 'S' || patch[3] != '1') [[unlikely]] {
+				return Result::InvalidPatch;
+			}
+
+			if constexpr (Policy::validateFirst) {
+				if (validate(patch, patchSize).result != Result::Success) {
+					return Result::InvalidPatch;
+				}
+			}
+
+			usize patchOffset = headerSize;
+			header.inputSize = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+			header.outputSize = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+			const u64 metadataSize = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+
+			// Skip over the metadata, which we don't have any use for
+			if (Policy::checkReads && (patchOffset > patchSize || metadataSize > patchSize - patchOffset)) {
+				return Result::InvalidPatch;
+			}
+
+			header.actionsOffset = patchOffset + metadataSize;
+			return Result::Success;
+		}
+
+		// Applies a patch to an output buffer of header.outputSize bytes, writing every byte of it. A checksum mismatch can be
+		// found either before the output is written (input or patch) or after, so "outputWritten" says whether it got that far
+		template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+		static Result apply(
+			u8* output, const Header& header, const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification,
+			bool& outputWritten, Observer& observer = Detail::nullObserver
+		) {
+			const u64 inputSize = header.inputSize;
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.actionsOffset;
+			outputWritten = false;
+			Detail::PhaseClock<Observer> clock(observer);
+
+			// The file we're trying to patch is smaller than the input is meant to be, reject it
+			if (dataSize < inputSize) {
+				observer.error(Result::SizeMismatch, headerSize);
+				return Result::SizeMismatch;
+			}
+
+			const Detail::Checksums checksums = Detail::readChecksums(patch, patchSize);
+			std::future<bool> inputsValid;
+
+			if (verification == Verification::Eager) {
+				if (!Detail::verifyChecksums(data, inputSize, patch, patchSize, checksums)) {
+					observer.error(Result::ChecksumMismatch, patchSize - 12);
+					return Result::ChecksumMismatch;
+				}
+			} else {
+				inputsValid = std::async(std::launch::async, Detail::verifyChecksums, data, inputSize, patch, patchSize, checksums);
+			}
+
+			clock.charge(PatchPhase::Checksum);
+
+			Detail::Crc32 outputCRC;
+			usize sourceOffset = 0;
+			usize outputOffset = 0;
+			usize outputOffset2 = 0; // Offset used for TargetCopy commands
+
+			while (patchOffset < patchSize - 12) {
+				const usize actionOffset = patchOffset;
+
+				// Each "record" in a BPS patch consists of a VLE word, whose bottom 2 bits are a patching "action" to perform
+				// And the top bits are the length of memory to operate on
+				const u64 word = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+				const u64 action = (word & 3);
+				const u64 length = (word >> 2) + 1;
+				const usize actionStart = outputOffset;
+
+				// An action writing past the end of the output means the patch is broken
+				if (length > outputSize - outputOffset) {
+					observer.error(Result::InvalidPatch, actionOffset);
+					return Result::InvalidPatch;
+				}
+
+				switch (action) {
+					case Action::SourceRead: {
+						// Copy from the same offset in the input file
+						if (outputOffset > dataSize || length > dataSize - outputOffset) {
+							observer.error(Result::InvalidPatch, actionOffset);
+							return Result::InvalidPatch;
+						}
+
+						clock.charge(PatchPhase::Decode);
+						std::memcpy(output + outputOffset, data + outputOffset, length);
+						outputOffset += length;
+						break;
+					}
+
+					case Action::TargetRead: {
+						clock.charge(PatchPhase::Decode);
+						Detail::readBytes(output + outputOffset, patch, patchOffset, patchSize, length);
+						outputOffset += length;
+						break;
+					}
+
+					case Action::SourceCopy: {
+						const u64 word = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+						const s64 offset = s64(word >> 1);
+						sourceOffset += (word & 1) ? -offset : +offset;
+
+						// Copying from outside the input file means the patch is broken
+						if (sourceOffset > dataSize || length > dataSize - sourceOffset) {
+							observer.error(Result::InvalidPatch, actionOffset);
+							return Result::InvalidPatch;
+						}
+
+						clock.charge(PatchPhase::Decode);
+						std::memcpy(output + outputOffset, data + sourceOffset, length);
+						outputOffset += length;
+						sourceOffset += length;
+						break;
+					}
+
+					case Action::TargetCopy: {
+						const u64 data = readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+						const s64 offset = s64(data >> 1);
+						outputOffset2 += (data & 1) ? -offset : +offset;
+
+						// We can only copy from the part of the output that's already been written
+						if (outputOffset2 >= outputOffset) {
+							observer.error(Result::InvalidPatch, actionOffset);
+							return Result::InvalidPatch;
+						}
+
+						clock.charge(PatchPhase::Decode);
+
+						// The source and destination overlap when the patch uses TargetCopy to encode a repeating pattern
+						Detail::copyForward(output + outputOffset, output + outputOffset2, length);
+						outputOffset += length;
+						outputOffset2 += length;
+						break;
+					}
+				}
+
+				observer.event(PatchEvent(u32(PatchEvent::BPSSourceRead) + u32(action)), length);
+				clock.charge(PatchPhase::Copy);
+				outputCRC.update(output + actionStart, outputOffset - actionStart);
+				clock.charge(PatchPhase::Checksum);
+
+				// The action was cut short by the end of the patch
+				if (Policy::checkReads && patchOffset > patchSize) {
+					observer.error(Result::InvalidPatch, actionOffset);
+					return Result::InvalidPatch;
+				}
+			}
+
+			// Pad rest of the output with 0s
+			if (outputOffset < outputSize) {
+				std::memset(output + outputOffset, 0, outputSize - outputOffset);
+				clock.charge(PatchPhase::Copy);
+				outputCRC.update(output + outputOffset, outputSize - outputOffset);
+			}
+
+			const bool inputsMatch = !inputsValid.valid() || inputsValid.get();
+			clock.charge(PatchPhase::Checksum);
+
+			if (!inputsMatch) {
+				observer.error(Result::ChecksumMismatch, patchSize - 12);
+				return Result::ChecksumMismatch;
+			}
+
+			outputWritten = true;
+			if (outputCRC.value() != checksums.output) {
+				observer.error(Result::ChecksumMismatch, patchSize - 8);
+				return Result::ChecksumMismatch;
+			}
+
+			return Result::Success;
+		}
+	}  // namespace BPS
+
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>, typename Observer = NullObserver>
+	static std::pair<std::vector<u8, Allocator>, Result> patchBPS(
+		const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification = Verification::Eager,
+		Observer& observer = Detail::nullObserver
+	) {
+		BPS::Header header;
+		if (const Result result = BPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+			observer.error(result, 0);
+			return {{}, result};
+		}
+
+		std::vector<u8, Allocator> output(header.outputSize);
+		observer.allocated(output.size());
+
+		bool outputWritten;
+		const Result result =
+			BPS::apply<Policy>(output.data(), header, data, dataSize, patch, patchSize, verification, outputWritten, observer);
+
+		// If the output's checksum doesn't match, it's still returned for the caller to inspect
+		if (!outputWritten) {
+			return {{}, result};
+		}
+
+		return {std::move(output), result};
+	}
+
+	// Same as above, but the patched file is written into "output" instead of a new vector. It has to have room for at least
+	// as many bytes as queryOutputSize returns, otherwise SizeMismatch is returned. Only that many bytes are written
+	template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+	static Result patchBPSInto(
+		std::span<u8> output, const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification = Verification::Eager,
+		Observer& observer = Detail::nullObserver
+	) {
+		BPS::Header header;
+		if (const Result result = BPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+			observer.error(result, 0);
+			return result;
+		}
+
+		if (output.size() < header.outputSize) {
+			observer.error(Result::SizeMismatch, 0);
+			return Result::SizeMismatch;
+		}
+
+		bool outputWritten;
+		return BPS::apply<Policy>(output.data(), header, data, dataSize, patch, patchSize, verification, outputWritten, observer);
+	}
+
+	// Patches with any of the supported formats. "observer" gets told what the patcher does (see NullObserver and PatchStats)
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>, typename Observer = NullObserver>
+	static std::pair<std::vector<u8, Allocator>, Result> patch(
+		const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type, Verification verification = Verification::Eager,
+		Observer& observer = Detail::nullObserver
+	) {
+		switch (type) {
+			case PatchType::IPS: return patchIPS<Policy, Allocator>(data, dataSize, patch, patchSize, observer);
+			case PatchType::UPS: return patchUPS<Policy, Allocator>(data, dataSize, patch, patchSize, verification, observer);
+			case PatchType::BPS: return patchBPS<Policy, Allocator>(data, dataSize, patch, patchSize, verification, observer);
+			default:
+				observer.error(Result::UnknownFormat, 0);
+				return {{}, Result::UnknownFormat};  // Unknown patch format
+		}
+	}
+
+	// Returns the size of the file a patch produces, so that a buffer for patchInto can be set up. For UPS and BPS patches this
+	// only reads the header, while IPS patches don't store it anywhere and need a pass over their records
+	template <typename Policy = ReadPolicy::Checked>
+	static std::pair<usize, Result> queryOutputSize(const u8* patch, usize patchSize, PatchType type) {
+		switch (type) {
+			case PatchType::IPS: {
+				const Result result = IPS::checkPatch<Policy>(patch, patchSize);
+				return {result == Result::Success ? IPS::getSize<Policy>(patch, patchSize) : 0, result};
+			}
+
+			case PatchType::UPS: {
+				UPS::Header header{};
+				const Result result = UPS::readHeader<Policy>(patch, patchSize, header);
+				return {usize(header.outputSize), result};
+			}
+
+			case PatchType::BPS: {
+				BPS::Header header{};
+				const Result result = BPS::readHeader<Policy>(patch, patchSize, header);
+				return {usize(header.outputSize), result};
+			}
+
+			default: return {0, Result::UnknownFormat};
+		}
+	}
+
+	// Applies a patch into memory owned by the caller (eg an arena, or a mapped file) instead of allocating the output.
+	// "output" needs room for at least as many bytes as queryOutputSize returns, and exactly that many are written
+	template <typename Policy = ReadPolicy::Checked, typename Observer = NullObserver>
+	static Result patchInto(
+		std::span<u8> output, const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type,
+		Verification verification = Verification::Eager, Observer& observer = Detail::nullObserver
+	) {
+		switch (type) {
+			case PatchType::IPS: return patchIPSInto<Policy>(output, data, dataSize, patch, patchSize, observer);
+			case PatchType::UPS: return patchUPSInto<Policy>(output, data, dataSize, patch, patchSize, verification, observer);
+			case PatchType::BPS: return patchBPSInto<Policy>(output, data, dataSize, patch, patchSize, verification, observer);
+			default:
+				observer.error(Result::UnknownFormat, 0);
+				return Result::UnknownFormat;  // Unknown patch format
+		}
+	}
+
+	// Fixed set of worker threads for running batches of independent tasks, eg the patches of patchBatch. Every worker gets a
+	// contiguous share of the batch and works through it front to back, and workers that run out steal from the back of the
+	// others' shares, so a few slow tasks don't leave the rest of the workers idle
+	class ThreadPool {
+	  public:
+		// 0 threads means one per hardware thread
+		explicit ThreadPool(usize threadCount = 0) {
+			if (threadCount == 0) {
+				threadCount = std::max<usize>(std::thread::hardware_concurrency(), 1);
+			}
+
+			queues = std::make_unique<Queue[]>(threadCount);
+			workers.reserve(threadCount);
+			for (usize i = 0; i < threadCount; i++) {
+				workers.emplace_back([this, i] { workerLoop(i); });
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		~ThreadPool() {
+			{
+				std::lock_guard lock(mutex);
+				stopping = true;
+			}
+
+			wake.notify_all();
+			for (auto& worker : workers) {
+				worker.join();
+			}
+		}
+
+		usize threadCount() const { return workers.size(); }
+
+		// Calls task(index, worker) for every index in [0, count) and returns once all of them are done. "worker" is in
+		// [0, threadCount()) and no 2 tasks run on the same worker at once, so it can index per-worker scratch data.
+		// Batches from different threads run one after the other, and tasks can't start batches of their own on the same pool
+		template <typename Task>
+		void run(usize count, Task&& task) {
+			if (count == 0) {
+				return;
+			}
+
+			std::lock_guard batchLock(batchMutex);
+			const usize threads = threadCount();
+			for (usize i = 0; i < threads; i++) {
+				std::lock_guard lock(queues[i].mutex);
+				for (usize index = count * i / threads; index < count * (i + 1) / threads; index++) {
+					queues[i].tasks.push_back(index);
+				}
+			}
+
+			std::unique_lock lock(mutex);
+			current = [&task](usize index, usize worker) { task(index, worker); };
+			remaining = count;
+			busyWorkers = threads;
+			generation++;
+			wake.notify_all();
+
+			// Wait for the workers to stop looking for tasks too, so none of them picks up the next batch with this task
+			done.wait(lock, [this] { return remaining == 0 && busyWorkers == 0; });
+			current = nullptr;
+		}
+
+	  private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<usize> tasks;
+		};
+
+		std::vector<std::thread> workers;
+		std::unique_ptr<Queue[]> queues;
+
+		std::mutex batchMutex;  // Held for the whole of a run() call
+		std::mutex mutex;       // Guards everything below
+		std::condition_variable wake;
+		std::condition_variable done;
+		std::function<void(usize, usize)> current;
+		u64 generation = 0;
+		usize remaining = 0;
+		usize busyWorkers = 0;
+		bool stopping = false;
+
+		// Takes the next task from the front of our own queue, or steals one from the back of someone else's
+		bool takeTask(usize worker, usize& index) {
+			const usize threads = threadCount();
+			for (usize i = 0; i < threads; i++) {
+				Queue& queue = queues[(worker + i) % threads];
+				std::lock_guard lock(queue.mutex);
+
+				if (!queue.tasks.empty()) {
+					if (i == 0) {
+						index = queue.tasks.front();
+						queue.tasks.pop_front();
+					} else {
+						index = queue.tasks.back();
+						queue.tasks.pop_back();
+					}
+
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void workerLoop(usize worker) {
+			u64 seenGeneration = 0;
+
+			while (true) {
+				const std::function<void(usize, usize)>* task;
+				{
+					std::unique_lock lock(mutex);
+					wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+					if (stopping) {
+						return;
+					}
+
+					seenGeneration = generation;
+					task = &current;
+				}
+
+				usize index;
+				usize finished = 0;
+				while (takeTask(worker, index)) {
+					(*task)(index, worker);
+					finished++;
+				}
+
+				std::lock_guard lock(mutex);
+				remaining -= finished;
+				busyWorkers--;
+				if (remaining == 0 && busyWorkers == 0) {
+					done.notify_one();
+				}
+			}
+		}
+	};
+
+	// CRC32 (the same one as zlib, and the one UPS and BPS patches use) of "length" bytes, continuing from the CRC32 "crc" of
+	// the data before them
+	static inline u32 crc32(const u8* data, usize length, u32 crc = 0) { return Detail::crc32(data, length, crc); }
+
+	// Returns the CRC32 of 2 pieces of data put together, from the CRC32 of each piece and the length of the second one
+	static constexpr u32 crc32Combine(u32 first, u32 second, u64 secondLength) { return Detail::crc32Combine(first, second, secondLength); }
+
+	// Same as crc32, but large buffers are split in one chunk per thread of "pool", whose CRC32s get combined at the end.
+	// Gives the exact same value as crc32
+	static u32 crc32(ThreadPool& pool, const u8* data, usize length, u32 crc = 0) {
+		// Smaller chunks aren't worth handing to another thread
+		constexpr usize minimumChunkSize = 1024 * 1024;
+		const usize chunks = std::min<usize>(pool.threadCount(), length / minimumChunkSize);
+		if (chunks <= 1) {
+			return Detail::crc32(data, length, crc);
+		}
+
+		std::vector<u32> chunkCRCs(chunks);
+		pool.run(chunks, [&](usize chunk, usize /* worker */) {
+			const usize begin = length * chunk / chunks;
+			const usize end = length * (chunk + 1) / chunks;
+			chunkCRCs[chunk] = Detail::crc32(data + begin, end - begin);
+		});
+
+		for (usize chunk = 0; chunk < chunks; chunk++) {
+			const usize chunkSize = length * (chunk + 1) / chunks - length * chunk / chunks;
+			crc = Detail::crc32Combine(crc, chunkCRCs[chunk], chunkSize);
+		}
+
+		return crc;
+	}
+
+	// One patch in a chain of patches applied one after the other, see CompiledPatch::compose
+	struct ChainedPatch {
+		const u8* patch;
+		usize patchSize;
+		PatchType type;
+	};
+
+	// A patch decoded once into a flat list of operations, for applying the same patch to lots of files. Applying it doesn't
+	// parse anything, it just goes through the operations, which are stored as a struct of arrays with absolute offsets.
+	// Compiled patches can be serialized, eg to cache them on disk
+	class CompiledPatch {
+	  public:
+		enum class Op : u8 {
+			Copy,        // Copy input[source, source + length), reading 0s past the end of the input
+			Literal,     // Copy literals[source, source + length)
+			Fill,        // Fill with the byte in "source"
+			TargetCopy,  // Copy output[source, source + length), which can overlap the destination to repeat a pattern
+			Xor,         // XOR input[target, target + length) with literals[source, source + length), reading 0s past the end of the input. See xorInputs
+		};
+
+		// Whether the literal bytes are copied out of the patch, or referenced in it. Borrowing them saves copying (and keeping
+		// around) the biggest part of most patches, but the patch then has to outlive the compiled patch
+		enum class Literals : u32 { Copy, Borrow };
+
+		CompiledPatch() {}
+
+		static std::pair<CompiledPatch, Result> compile(const u8* patch, usize patchSize, PatchType type, Literals literals = Literals::Copy) {
+			CompiledPatch compiled;
+			compiled.type = type;
+			compiled.borrowedLiterals = (literals == Literals::Borrow) ? patch : nullptr;
+
+			Result result;
+			switch (type) {
+				case PatchType::IPS: result = compiled.compileIPS(patch, patchSize); break;
+				case PatchType::UPS: result = compiled.compileUPS(patch, patchSize); break;
+				case PatchType::BPS: result = compiled.compileBPS(patch, patchSize); break;
+				default: result = Result::UnknownFormat; break;
+			}
+
+			if (result != Result::Success) {
+				return {CompiledPatch(), result};
+			}
+
+			compiled.buildSchedule();
+			return {std::move(compiled), Result::Success};
+		}
+
+		// Folds a chain of patches, applied one after the other, into a single patch that maps every byte of the final output
+		// straight back to the input, the patches' literals or earlier output. Applying it writes the output once, instead of
+		// writing (and reading back) the output of every patch in the chain.
+		// The input checksum of the first patch and the output checksum of the last one are checked when it's applied. The ones
+		// in between can't be without building the outputs in between, but with the right input those are always the same, so
+		// they only catch patches that don't go together. Composed patches are applied the same way as BPS patches, which is
+		// what patchType() says they are
+		static std::pair<CompiledPatch, Result> compose(std::span<const ChainedPatch> patches) {
+			if (patches.empty()) {
+				return {CompiledPatch(), Result::InvalidPatch};
+			}
+
+			// Before the first patch, the output is the input
+			CompiledPatch composed;
+			composed.type = PatchType::BPS;
+			composed.append(Op::Copy, ~u64(0), 0, 0);
+
+			for (usize i = 0; i < patches.size(); i++) {
+				auto [layer, result] = compile(patches[i].patch, patches[i].patchSize, patches[i].type, Literals::Borrow);
+				if (result != Result::Success) {
+					return {CompiledPatch(), result};
+				}
+
+				// Checked the same way applying the patch on its own checks the size of its input
+				if (i != 0 && layer.inputSize > composed.expectedOutputSize) {
+					return {CompiledPatch(), Result::SizeMismatch};
+				} else if (i != 0 && layer.minimumInputSize > composed.expectedOutputSize) {
+					return {CompiledPatch(), Result::InvalidPatch};
+				}
+
+				composed.fold(layer);
+				if (i == 0) {
+					composed.inputChecksummed = layer.inputChecksummed;
+					composed.inputSize = layer.inputSize;
+					composed.minimumInputSize = layer.minimumInputSize;
+					composed.expectedInputCRC = layer.expectedInputCRC;
+				}
+
+				composed.outputChecksummed = layer.outputChecksummed;
+				composed.expectedOutputCRC = layer.expectedOutputCRC;
+			}
+
+			composed.compactLiterals();
+			composed.dropXorInputs();
+			composed.buildSchedule();
+			return {std::move(composed), Result::Success};
+		}
+
+		PatchType patchType() const { return type; }
+		usize outputSize() const { return usize(expectedOutputSize); }
+		usize operationCount() const { return ops.size(); }
+
+		// Same as patchInto. "output" needs room for at least outputSize() bytes, and exactly that many are written
+		Result applyInto(std::span<u8> output, const u8* data, usize dataSize, Verification verification = Verification::Eager) const {
+			if (output.size() < expectedOutputSize) {
+				return Result::SizeMismatch;
+			}
+
+			bool outputWritten;
+			return applyTo(output.data(), data, dataSize, verification, outputWritten);
+		}
+
+		// Same as patch. If the output's checksum doesn't match, it's still returned for the caller to inspect
+		template <typename Allocator = std::allocator<u8>>
+		std::pair<std::vector<u8, Allocator>, Result> apply(const u8* data, usize dataSize, Verification verification = Verification::Eager) const {
+			std::vector<u8, Allocator> output(outputSize());
+			bool outputWritten;
+			const Result result = applyTo(output.data(), data, dataSize, verification, outputWritten);
+
+			if (!outputWritten) {
+				return {{}, result};
+			}
+
+			return {std::move(output), result};
+		}
+
+		// Same as the above, but the operations are run in parallel on "pool". For UPS and BPS patches, operations that don't
+		// depend on each other run at the same time, while TargetCopies wait for the operations writing what they copy. For IPS
+		// patches, the output is split into stripes that each apply their part of the records in order
+		Result applyInto(
+			std::span<u8> output, const u8* data, usize dataSize, ThreadPool& pool, Verification verification = Verification::Eager
+		) const {
+			if (output.size() < expectedOutputSize) {
+				return Result::SizeMismatch;
+			}
+
+			bool outputWritten;
+			return applyTo(output.data(), data, dataSize, verification, outputWritten, &pool);
+		}
+
+		template <typename Allocator = std::allocator<u8>>
+		std::pair<std::vector<u8, Allocator>, Result> apply(
+			const u8* data, usize dataSize, ThreadPool& pool, Verification verification = Verification::Eager
+		) const {
+			std::vector<u8, Allocator> output(outputSize());
+			bool outputWritten;
+			const Result result = applyTo(output.data(), data, dataSize, verification, outputWritten, &pool);
+
+			if (!outputWritten) {
+				return {{}, result};
+			}
+
+			return {std::move(output), result};
+		}
+
+		// Writes this patch out as a BPS patch for "data", so composed patches can be handed to other tools. The data is needed
+		// for the checksums, and for the output of XORs, which BPS can't express and gets stored as it is
+		std::pair<std::vector<u8>, Result> toBPS(const u8* data, usize dataSize) const {
+			// IPS records can overwrite each other, while BPS actions write the output front to back
+			if (type == PatchType::IPS) {
+				return flattened().toBPS(data, dataSize);
+			}
+
+			auto [output, result] = apply<DefaultInitAllocator<u8>>(data, dataSize);
+			if (result != Result::Success) {
+				return {{}, result};
+			}
+
+			std::vector<u8> out = {'B', 'P', 'S', '1'};
+			Detail::writeRunLength(out, dataSize);
+			Detail::writeRunLength(out, expectedOutputSize);
+			Detail::writeRunLength(out, 0);  // No metadata
+
+			u64 sourceRelativeOffset = 0;
+			u64 targetRelativeOffset = 0;
+			u64 literalStart = 0;  // Output that's written as it is, with TargetRead, once the next action comes up
+
+			const auto writeAction = [&](u32 action, u64 length) { Detail::writeRunLength(out, ((length - 1) << 2) | action); };
+			const auto writeRelativeOffset = [&](u64& relativeOffset, u64 offset, u64 length) {
+				const bool negative = offset < relativeOffset;
+				const u64 distance = negative ? relativeOffset - offset : offset - relativeOffset;
+				Detail::writeRunLength(out, (distance << 1) | (negative ? 1 : 0));
+				relativeOffset = offset + length;
+			};
+
+			const auto writeLiterals = [&](u64 end) {
+				if (end > literalStart) {
+					writeAction(BPS::Action::TargetRead, end - literalStart);
+					out.insert(out.end(), output.begin() + usize(literalStart), output.begin() + usize(end));
+				}
+
+				literalStart = end;
+			};
+
+			// Runs of the same byte are written once, then copied over themselves
+			const auto writeFill = [&](u64 offset, u64 length) {
+				if (length < 4) {
+					return;
+				}
+
+				writeLiterals(offset + 1);
+				writeAction(BPS::Action::TargetCopy, length - 1);
+				writeRelativeOffset(targetRelativeOffset, offset, length - 1);
+				literalStart = offset + length;
+			};
+
+			for (usize i = 0; i < ops.size(); i++) {
+				const u64 target = targets[i];
+				const u64 length = lengths[i];
+				const u64 source = sources[i];
+
+				switch (ops[i]) {
+					case Op::Copy: {
+						// Only the part of it inside the input can be copied, the rest is 0s
+						const u64 inside = source < dataSize ? std::min<u64>(length, dataSize - source) : 0;
+						if (inside != 0) {
+							writeLiterals(target);
+							writeAction(source == target ? BPS::Action::SourceRead : BPS::Action::SourceCopy, inside);
+							if (source != target) {
+								writeRelativeOffset(sourceRelativeOffset, source, inside);
+							}
+
+							literalStart = target + inside;
+						}
+
+						writeFill(target + inside, length - inside);
+						break;
+					}
+
+					case Op::Fill: writeFill(target, length); break;
+					case Op::TargetCopy:
+						writeLiterals(target);
+						writeAction(BPS::Action::TargetCopy, length);
+						writeRelativeOffset(targetRelativeOffset, source, length);
+						literalStart = target + length;
+						break;
+
+					case Op::Literal:
+					case Op::Xor: break;
+				}
+			}
+
+			writeLiterals(expectedOutputSize);
+			Detail::writeLE32(out, Detail::crc32(data, dataSize));
+			Detail::writeLE32(out, Detail::crc32(output.data(), output.size()));
+			Detail::writeLE32(out, Detail::crc32(out.data(), out.size()));
+			return {std::move(out), Result::Success};
+		}
+
+		std::vector<u8> serialize() const {
+			std::vector<u8> out;
+			const auto put = [&](u64 value, usize size) {
+				for (usize i = 0; i < size; i++) {
+					out.push_back(u8(value >> (i * 8)));
+				}
+			};
+
+			// Literals only get written if an operation uses them, so borrowed literals don't drag the whole patch along
+			u64 literalSize = 0;
+			for (usize i = 0; i < ops.size(); i++) {
+				if (ops[i] == Op::Literal || ops[i] == Op::Xor) {
+					literalSize += lengths[i];
+				}
+			}
+
+			out.insert(out.end(), serializedMagic, serializedMagic + 4);
+			put(serializedVersion, 4);
+			put(u64(type), 4);
+			put((inputChecksummed ? 1 : 0) | (outputChecksummed ? 2 : 0), 4);
+			put(inputSize, 8);
+			put(expectedOutputSize, 8);
+			put(minimumInputSize, 8);
+			put(expectedInputCRC, 4);
+			put(expectedOutputCRC, 4);
+			put(ops.size(), 8);
+			put(literalSize, 8);
+
+			// Literals are written in the same order as the operations using them, so the literal offset of an XOR follows from
+			// the ones before it, and the offset of the input it reads goes in its place
+			u64 literalOffset = 0;
+			for (usize i = 0; i < ops.size(); i++) {
+				put(u64(ops[i]), 1);
+				put(lengths[i], 8);
+				put(targets[i], 8);
+
+				switch (ops[i]) {
+					case Op::Literal: put(literalOffset, 8); break;
+					case Op::Xor: put(xorInput(i), 8); break;
+					default: put(sources[i], 8); break;
+				}
+
+				literalOffset += (ops[i] == Op::Literal || ops[i] == Op::Xor) ? lengths[i] : 0;
+			}
+
+			const u8* literals = literalData();
+			for (usize i = 0; i < ops.size(); i++) {
+				if (ops[i] == Op::Literal || ops[i] == Op::Xor) {
+					out.insert(out.end(), literals + sources[i], literals + sources[i] + lengths[i]);
+				}
+			}
+
+			put(Detail::crc32(out.data(), out.size()), 4);
+			return out;
+		}
+
+		// Loads a compiled patch written by serialize(). Everything is checked, as applying it afterwards isn't
+		static std::pair<CompiledPatch, Result> deserialize(const u8* data, usize size) {
+			constexpr usize headerSize = 4 + 4 * 3 + 8 * 3 + 4 * 2 + 8 * 2;
+			constexpr usize opSize = 1 + 8 * 3;
+
+			if (data == nullptr || size < headerSize + 4 || std::memcmp(data, serializedMagic, 4) != 0) {
+				return {CompiledPatch(), Result::InvalidPatch};
+			}
+
+			usize offset = size - 4;
+			if (Detail::crc32(data, size - 4) != Detail::readLE<u32, 4>(data, offset, size)) {
+				return {CompiledPatch(), Result::ChecksumMismatch};
+			}
+
+			offset = 4;
+			CompiledPatch compiled;
+			const u32 version = Detail::readLE<u32, 4>(data, offset, size);
+			const u32 type = Detail::readLE<u32, 4>(data, offset, size);
+			const u32 checksums = Detail::readLE<u32, 4>(data, offset, size);
+			compiled.inputSize = Detail::readLE<u64, 8>(data, offset, size);
+			compiled.expectedOutputSize = Detail::readLE<u64, 8>(data, offset, size);
+			compiled.minimumInputSize = Detail::readLE<u64, 8>(data, offset, size);
+			compiled.expectedInputCRC = Detail::readLE<u32, 4>(data, offset, size);
+			compiled.expectedOutputCRC = Detail::readLE<u32, 4>(data, offset, size);
+			const u64 opCount = Detail::readLE<u64, 8>(data, offset, size);
+			const u64 literalSize = Detail::readLE<u64, 8>(data, offset, size);
+
+			// Version 1 had a single flag for both checksums, and XORs always read the input where they write. It isn't read anymore
+			if (version != serializedVersion || type > u32(PatchType::BPS) ||
+				opCount > (size - 4 - headerSize) / opSize || literalSize != size - 4 - headerSize - opCount * opSize) {
+				return {CompiledPatch(), Result::InvalidPatch};
+			}
+
+			compiled.type = PatchType(type);
+			compiled.inputChecksummed = (checksums & 1) != 0;
+			compiled.outputChecksummed = (checksums & 2) != 0;
+			compiled.reserve(usize(opCount));
+			compiled.xorInputs.reserve(usize(opCount));
+			u64 literalOffset = 0;
+			const u64 outputSize = compiled.expectedOutputSize;
+			// IPS output is covered by copying the input first, UPS and BPS output is written front to back with no gaps
+			u64 written = 0;
+
+			for (u64 i = 0; i < opCount; i++) {
+				const u8 op = Detail::readLE<u8, 1>(data, offset, size);
+				const u64 length = Detail::readLE<u64, 8>(data, offset, size);
+				const u64 target = Detail::readLE<u64, 8>(data, offset, size);
+				u64 source = Detail::readLE<u64, 8>(data, offset, size);
+				u64 input = target;
+
+				if (op == u8(Op::Xor)) {
+					input = source;
+					source = literalOffset;
+				}
+
+				bool valid = op <= u8(Op::Xor) && target <= outputSize && length <= outputSize - target;
+				switch (Op(op)) {
+					case Op::Copy: break;
+					case Op::Literal: valid = valid && source <= literalSize && length <= literalSize - source; break;
+					case Op::Xor: valid = valid && source <= literalSize && length <= literalSize - source && length <= ~u64(0) - input; break;
+					case Op::Fill: valid = valid && source <= 0xFF; break;
+					case Op::TargetCopy: valid = valid && source < target; break;
+				}
+
+				literalOffset += (op == u8(Op::Literal) || op == u8(Op::Xor)) ? length : 0;
+
+				if (compiled.type == PatchType::IPS) {
+					valid = valid && (i != 0 || (Op(op) == Op::Copy && target == 0 && length == outputSize));
+					written = outputSize;
+				} else {
+					valid = valid && target == written;
+					written += length;
+				}
+
+				if (!valid) {
+					return {CompiledPatch(), Result::InvalidPatch};
+				}
+
+				compiled.push(Op(op), length, target, source);
+				if (length != 0) {
+					compiled.xorInputs.push_back(input);
+				}
+			}
+
+			if (written != outputSize) {
+				return {CompiledPatch(), Result::InvalidPatch};
+			}
+
+			compiled.literals.assign(data + offset, data + offset + literalSize);
+			compiled.dropXorInputs();
+			compiled.buildSchedule();
+			return {std::move(compiled), Result::Success};
+		}
+
+	  private:
+		static constexpr u8 serializedMagic[4] = {'H', 'I', 'P', 'C'};
+		static constexpr u32 serializedVersion = 2;
+		static constexpr usize checksumBlockSize = 64 * 1024;
+		// Outputs smaller than this are patched on the calling thread, and levels are split in pieces of at least parallelPieceSize
+		static constexpr usize parallelMinimumSize = 1024 * 1024;
+		static constexpr usize parallelPieceSize = 256 * 1024;
+
+		std::vector<Op> ops;
+		std::vector<u64> lengths;
+		std::vector<u64> targets;
+		std::vector<u64> sources;  // Input/output offset, literal offset or fill value depending on the operation
+		// Where every operation reads the input for XORs, in composed patches where that isn't always where they write. Empty
+		// otherwise, in which case XORs read the input at their target
+		std::vector<u64> xorInputs;
+
+		std::vector<u8> literals;
+		const u8* borrowedLiterals = nullptr;
+
+		// UPS and BPS operations in the order they can run in parallel, see buildSchedule
+		std::vector<usize> schedule;
+		std::vector<usize> levelStarts;     // Where each level starts in the schedule
+		std::vector<u64> scheduleOffsets;  // How many bytes the operations before each one in the schedule write
+
+		PatchType type = PatchType::IPS;
+		bool inputChecksummed = false;
+		bool outputChecksummed = false;
+		u64 inputSize = 0;
+		u64 expectedOutputSize = 0;
+		u64 minimumInputSize = 0;
+		u32 expectedInputCRC = 0;
+		u32 expectedOutputCRC = 0;
+
+		const u8* literalData() const { return borrowedLiterals != nullptr ? borrowedLiterals : literals.data(); }
+		u64 xorInput(usize i) const { return xorInputs.empty() ? targets[i] : xorInputs[i]; }
+
+		void dropXorInputs() {
+			for (usize i = 0; i < xorInputs.size(); i++) {
+				if (ops[i] == Op::Xor && xorInputs[i] != targets[i]) {
+					return;
+				}
+			}
+
+			xorInputs.clear();
+		}
+
+		void reserve(usize count) {
+			ops.reserve(count);
+			lengths.reserve(count);
+			targets.reserve(count);
+			sources.reserve(count);
+		}
+
+		void push(Op op, u64 length, u64 target, u64 source) {
+			if (length == 0) {
+				return;
+			}
+
+			ops.push_back(op);
+			lengths.push_back(length);
+			targets.push_back(target);
+			sources.push_back(source);
+		}
+
+		// Literals point into the patch when they're borrowed, otherwise they get copied to our own storage
+		u64 addLiteral(const u8* patch, usize offset, usize length) {
+			if (borrowedLiterals != nullptr) {
+				return offset;
+			}
+
+			literals.insert(literals.end(), patch + offset, patch + offset + length);
+			return literals.size() - length;
+		}
+
+		// Runs the operations on an output buffer of outputSize() bytes, in parallel on "pool" if there is one. Like the patchers,
+		// "outputWritten" says whether a checksum mismatch was found before or after writing the output
+		Result applyTo(u8* out, const u8* data, usize dataSize, Verification verification, bool& outputWritten, ThreadPool* pool = nullptr) const {
+			outputWritten = false;
+
+			// The file we're trying to patch is smaller than the input is meant to be, reject it
+			if (dataSize < inputSize) {
+				return Result::SizeMismatch;
+			}
+
+			std::future<bool> inputValid;
+			if (inputChecksummed) {
+				if (verification == Verification::Eager) {
+					const usize size = usize(inputSize);
+					if ((pool != nullptr ? crc32(*pool, data, size) : Detail::crc32(data, size)) != expectedInputCRC) {
+						return Result::ChecksumMismatch;
+					}
+				} else {
+					inputValid = std::async(std::launch::async, [=, this] { return Detail::crc32(data, usize(inputSize)) == expectedInputCRC; });
+				}
+			}
+
+			// BPS copies from the input are bounds checked against the actual size of the file, not the size in the header
+			if (dataSize < minimumInputSize) {
+				return Result::InvalidPatch;
+			}
+
+			const u8* literals = literalData();
+			u32 outputCRC;
+
+			const bool parallel = pool != nullptr && pool->threadCount() > 1 && expectedOutputSize >= parallelMinimumSize;
+			if (parallel && type == PatchType::IPS) {
+				runStripes(out, data, dataSize, literals, *pool);
+				outputCRC = 0;
+			} else if (parallel) {
+				runParallel(out, data, dataSize, literals, *pool);
+				outputCRC = outputChecksummed ? crc32(*pool, out, usize(expectedOutputSize)) : 0;
+			} else {
+				Detail::Crc32 crc;
+				usize checksummedSize = 0;
+
+				for (usize i = 0; i < ops.size(); i++) {
+					runOperation(i, out, data, dataSize, literals, 0, usize(lengths[i]));
+
+					// UPS and BPS output is written front to back, so checksum it in blocks while it's still in cache
+					const usize end = usize(targets[i] + lengths[i]);
+					if (outputChecksummed && end - checksummedSize >= checksumBlockSize) {
+						crc.update(out + checksummedSize, end - checksummedSize);
+						checksummedSize = end;
+					}
+				}
+
+				if (outputChecksummed) {
+					crc.update(out + checksummedSize, usize(expectedOutputSize) - checksummedSize);
+				}
+
+				outputCRC = crc.value();
+			}
+
+			if (inputValid.valid() && !inputValid.get()) {
+				return Result::ChecksumMismatch;
+			}
+
+			outputWritten = true;
+			return (!outputChecksummed || outputCRC == expectedOutputCRC) ? Result::Success : Result::ChecksumMismatch;
+		}
+
+		// Writes bytes [begin, end) of what operation "i" writes
+		void runOperation(usize i, u8* out, const u8* data, usize dataSize, const u8* literals, usize begin, usize end) const {
+			u8* dest = out + targets[i] + begin;
+			const usize length = end - begin;
+			const usize source = usize(sources[i]);
+
+			switch (ops[i]) {
+				case Op::Copy: {
+					const usize offset = source + begin;
+					const usize available = offset < dataSize ? std::min<usize>(length, dataSize - offset) : 0;
+					if (available != 0) {
+						std::memcpy(dest, data + offset, available);
+					}
+
+					std::memset(dest + available, 0, length - available);
+					break;
+				}
+
+				case Op::Literal: std::memcpy(dest, literals + source + begin, length); break;
+				case Op::Fill: std::memset(dest, u8(source), length); break;
+				case Op::TargetCopy: Detail::copyForward(dest, out + source + begin, length); break;
+
+				case Op::Xor: {
+					const usize offset = usize(xorInput(i)) + begin;
+					const usize available = offset < dataSize ? std::min<usize>(length, dataSize - offset) : 0;
+					const u8* input = data + std::min(offset, dataSize);  // Only read if some of it is inside the input
+					const u8* patch = literals + source + begin;
+
+					for (usize j = 0; j < available; j++) {
+						dest[j] = input[j] ^ patch[j];
+					}
+
+					std::memcpy(dest + available, patch + available, length - available);
+					break;
+				}
+			}
+		}
+
+		// Runs the schedule one level at a time, splitting each level into pieces of about the same size for the pool
+		void runParallel(u8* out, const u8* data, usize dataSize, const u8* literals, ThreadPool& pool) const {
+			for (usize level = 0; level + 1 < levelStarts.size(); level++) {
+				const usize first = levelStarts[level];
+				const usize last = levelStarts[level + 1];
+				const u64 levelStart = scheduleOffsets[first];
+				const u64 levelSize = scheduleOffsets[last] - levelStart;
+				// Levels that are too small to split are run on this thread, instead of waking up the pool for them
+				const usize pieces = usize(std::min<u64>(pool.threadCount() * 4, levelSize / parallelPieceSize));
+
+				const auto runPiece = [&](usize piece, usize /* worker */) {
+					const u64 begin = levelStart + levelSize * piece / std::max<usize>(pieces, 1);
+					const u64 end = levelStart + levelSize * (piece + 1) / std::max<usize>(pieces, 1);
+					usize j = usize(std::upper_bound(&scheduleOffsets[first], &scheduleOffsets[last], begin) - &scheduleOffsets[0]) - 1;
+
+					for (; j < last && scheduleOffsets[j] < end; j++) {
+						const usize op = schedule[j];
+						usize from = usize(std::max<u64>(begin, scheduleOffsets[j]) - scheduleOffsets[j]);
+						usize to = usize(std::min<u64>(end, scheduleOffsets[j + 1]) - scheduleOffsets[j]);
+
+						// TargetCopies that repeat a pattern read what they write themselves, so they can't be split up.
+						// The piece they start in runs them whole
+						if (ops[op] == Op::TargetCopy && sources[op] + lengths[op] > targets[op]) {
+							if (from != 0) {
+								continue;
+							}
+
+							to = usize(lengths[op]);
+						}
+
+						runOperation(op, out, data, dataSize, literals, from, to);
+					}
+				};
+
+				if (pieces <= 1) {
+					runPiece(0, 0);
+				} else {
+					pool.run(pieces, runPiece);
+				}
+			}
+		}
+
+		// IPS records can overlap, with later ones winning, so instead of running them in levels the output is split into stripes.
+		// Each stripe runs the part of every record that falls in it, in the same order as the patch
+		void runStripes(u8* out, const u8* data, usize dataSize, const u8* literals, ThreadPool& pool) const {
+			const u64 outputSize = expectedOutputSize;
+			const usize stripes = usize(std::clamp<u64>(outputSize / parallelPieceSize, 1, pool.threadCount() * 4));
+			const u64 stripeSize = (outputSize + stripes - 1) / stripes;
+
+			std::vector<std::vector<usize>> stripeOps(stripes);
+			for (usize i = 0; i < ops.size(); i++) {
+				const usize firstStripe = usize(targets[i] / stripeSize);
+				const usize lastStripe = usize((targets[i] + lengths[i] - 1) / stripeSize);
+
+				for (usize stripe = firstStripe; stripe <= lastStripe; stripe++) {
+					stripeOps[stripe].push_back(i);
+				}
+			}
+
+			pool.run(stripes, [&](usize stripe, usize /* worker */) {
+				const u64 stripeStart = stripeSize * stripe;
+				const u64 stripeEnd = std::min<u64>(stripeStart + stripeSize, outputSize);
+
+				for (const usize op : stripeOps[stripe]) {
+					const u64 from = std::max<u64>(stripeStart, targets[op]) - targets[op];
+					const u64 to = std::min<u64>(stripeEnd, targets[op] + lengths[op]) - targets[op];
+					runOperation(op, out, data, dataSize, literals, usize(from), usize(to));
+				}
+			});
+		}
+
+		// Operations of UPS and BPS patches write separate parts of the output, so the only thing stopping them from running
+		// in parallel is TargetCopy reading output written by earlier operations. This groups them into levels where each
+		// operation only reads output written by lower levels, so every level can run in parallel once the ones below it are done
+		void buildSchedule() {
+			if (type == PatchType::IPS) {
+				return;
+			}
+
+			// Segment tree with the level of every operation so far, for finding the highest level among the ones a TargetCopy reads
+			const usize count = ops.size();
+			const usize leaves = std::bit_ceil(std::max<usize>(count, 1));
+			std::vector<u32> tree(leaves * 2, 0);
+			std::vector<u32> levels(count, 0);
+			u32 levelCount = 1;
+
+			for (usize i = 0; i < count; i++) {
+				if (ops[i] != Op::TargetCopy) {
+					continue;
+				}
+
+				// Operations are sorted by where they write, so the ones writing [readStart, readEnd) are found by binary search
+				const u64 readStart = sources[i];
+				const u64 readEnd = std::min<u64>(sources[i] + lengths[i], targets[i]);
+				const usize firstWriter = usize(std::upper_bound(targets.begin(), targets.begin() + i, readStart) - targets.begin()) - 1;
+				const usize lastWriter = usize(std::upper_bound(targets.begin(), targets.begin() + i, readEnd - 1) - targets.begin()) - 1;
+
+				u32 level = 0;
+				for (usize l = firstWriter + leaves, r = lastWriter + leaves + 1; l < r; l >>= 1, r >>= 1) {
+					if (l & 1) level = std::max<u32>(level, tree[l++]);
+					if (r & 1) level = std::max<u32>(level, tree[--r]);
+				}
+
+				levels[i] = level + 1;
+				levelCount = std::max<u32>(levelCount, level + 2);
+				for (usize node = i + leaves; node != 0; node >>= 1) {
+					tree[node] = std::max<u32>(tree[node], levels[i]);
+				}
+			}
+
+			// Counting sort by level, keeping the operations of each level in output order
+			levelStarts.assign(levelCount + 1, 0);
+			for (usize i = 0; i < count; i++) {
+				levelStarts[levels[i] + 1]++;
+			}
+
+			for (usize level = 0; level < levelCount; level++) {
+				levelStarts[level + 1] += levelStarts[level];
+			}
+
+			std::vector<usize> next(levelStarts.begin(), levelStarts.end() - 1);
+			schedule.resize(count);
+			for (usize i = 0; i < count; i++) {
+				schedule[next[levels[i]]++] = i;
+			}
+
+			scheduleOffsets.resize(count + 1);
+			scheduleOffsets[0] = 0;
+			for (usize j = 0; j < count; j++) {
+				scheduleOffsets[j + 1] = scheduleOffsets[j] + lengths[schedule[j]];
+			}
+		}
+
+		Result verifyPatchChecksum(const u8* patch, usize patchSize) {
+			const Detail::Checksums checksums = Detail::readChecksums(patch, patchSize);
+			if (Detail::crc32(patch, patchSize - 4) != checksums.patch) {
+				return Result::ChecksumMismatch;
+			}
+
+			inputChecksummed = true;
+			outputChecksummed = true;
+			expectedInputCRC = checksums.input;
+			expectedOutputCRC = checksums.output;
+			return Result::Success;
+		}
+
+		// IPS patches don't store the output size, so it's worked out while walking the records instead of in a separate pass
+		// like getSize does. Records can only grow the output, so none of them ever needs to be clamped to it
+		Result compileIPS(const u8* patch, usize patchSize) {
+			if (const Result result = IPS::checkPatch(patch, patchSize); result != Result::Success) {
+				return result;
+			}
+
+			// The output starts off as a copy of the input, with the records written over it. Its size is filled in at the end
+			ops.push_back(Op::Copy);
+			lengths.push_back(0);
+			targets.push_back(0);
+			sources.push_back(0);
+
+			usize outputSize = 0;
+			usize offset = IPS::headerSize;
+			while (offset < patchSize) {
+				const usize fileOffset = IPS::read<usize, 3>(patch, offset, patchSize);
+				if (fileOffset == IPS::endOfFile) {
+					break;
+				}
+
+				const u16 size = IPS::read<u16, 2>(patch, offset, patchSize);
+				if (size == 0) {
+					const u16 rleSize = IPS::read<u16, 2>(patch, offset, patchSize);
+					const u8 value = IPS::read<u8, 1>(patch, offset, patchSize);
+					push(Op::Fill, rleSize, fileOffset, value);
+					outputSize = std::max<usize>(outputSize, fileOffset + rleSize);
+				} else {
+					if (offset + size <= patchSize) {
+						push(Op::Literal, size, fileOffset, addLiteral(patch, offset, size));
+					}
+
+					offset += size;
+					outputSize = std::max<usize>(outputSize, fileOffset + size);
+				}
+
+				// The record was cut short by the end of the patch
+				if (offset > patchSize) {
+					return Result::InvalidPatch;
+				}
+			}
+
+			if (offset + 3 == patchSize) {
+				// Apparently some IPS files have a 3 byte footer with the ROM size after EOF
+				outputSize = std::max<usize>(outputSize, IPS::read<usize, 3>(patch, offset, patchSize));
+			}
+
+			expectedOutputSize = outputSize;
+			lengths[0] = outputSize;
+			if (outputSize == 0) {
+				ops.clear();
+				lengths.clear();
+				targets.clear();
+				sources.clear();
+			}
+
+			return Result::Success;
+		}
+
+		Result compileUPS(const u8* patch, usize patchSize) {
+			UPS::Header header;
+			if (const Result result = UPS::readHeader(patch, patchSize, header); result != Result::Success) {
+				return result;
+			}
+
+			if (const Result result = verifyPatchChecksum(patch, patchSize); result != Result::Success) {
+				return result;
+			}
+
+			inputSize = header.inputSize;
+			expectedOutputSize = header.outputSize;
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.hunksOffset;
+			u64 outputOffset = 0;
+
+			while (patchOffset < patchSize - 12 && outputOffset < outputSize) {
+				const u64 length = UPS::readRunLength<u64>(patch, patchOffset, patchSize);
+				if (patchOffset > patchSize) {
+					return Result::InvalidPatch;
+				}
+
+				// Unchanged bytes are copied from the same offset in the input
+				const u64 copyLength = std::min<u64>(length, outputSize - outputOffset);
+				push(Op::Copy, copyLength, outputOffset, outputOffset);
+				outputOffset += copyLength;
+
+				// The XOR run goes on until its terminating 0 (which is XORed in too), or until the output is full
+				const usize remaining = usize(outputSize - outputOffset);
+				const usize available = patchSize - patchOffset;
+				const u8* terminator = (const u8*)std::memchr(patch + patchOffset, 0, std::min<usize>(remaining, available));
+
+				usize runLength;
+				if (terminator != nullptr) {
+					runLength = usize(terminator - (patch + patchOffset)) + 1;
+				} else if (remaining <= available) {
+					runLength = remaining;
+				} else {
+					return Result::InvalidPatch;  // The run goes past the end of the patch
+				}
+
+				push(Op::Xor, runLength, outputOffset, addLiteral(patch, patchOffset, runLength));
+				patchOffset += runLength;
+				outputOffset += runLength;
+			}
+
+			// The rest of the output is copied from the input as-is
+			push(Op::Copy, outputSize - outputOffset, outputOffset, outputOffset);
+			return Result::Success;
+		}
+
+		Result compileBPS(const u8* patch, usize patchSize) {
+			BPS::Header header;
+			if (const Result result = BPS::readHeader(patch, patchSize, header); result != Result::Success) {
+				return result;
+			}
+
+			if (const Result result = verifyPatchChecksum(patch, patchSize); result != Result::Success) {
+				return result;
+			}
+
+			inputSize = header.inputSize;
+			expectedOutputSize = header.outputSize;
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.actionsOffset;
+			u64 outputOffset = 0;
+			u64 sourceOffset = 0;
+			u64 outputOffset2 = 0;  // Offset used for TargetCopy commands
+
+			while (patchOffset < patchSize - 12) {
+				const u64 word = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
+				const u64 action = (word & 3);
+				const u64 length = (word >> 2) + 1;
+
+				// An action writing past the end of the output means the patch is broken
+				if (patchOffset > patchSize || length > outputSize - outputOffset) {
+					return Result::InvalidPatch;
+				}
+
+				switch (action) {
+					case BPS::Action::SourceRead:
+						push(Op::Copy, length, outputOffset, outputOffset);
+						minimumInputSize = std::max<u64>(minimumInputSize, outputOffset + length);
+						break;
+
+					case BPS::Action::TargetRead:
+						if (length > patchSize - patchOffset) {
+							return Result::InvalidPatch;
+						}
+
+						push(Op::Literal, length, outputOffset, addLiteral(patch, patchOffset, usize(length)));
+						patchOffset += usize(length);
+						break;
+
+					case BPS::Action::SourceCopy: {
+						const u64 data = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
+						const u64 offset = data >> 1;
+						sourceOffset += (data & 1) ? -offset : +offset;
+
+						// The copy has to fit in the input, which we can only check once we know its size
+						if (patchOffset > patchSize || length > ~u64(0) - sourceOffset) {
+							return Result::InvalidPatch;
+						}
+
+						push(Op::Copy, length, outputOffset, sourceOffset);
+						minimumInputSize = std::max<u64>(minimumInputSize, sourceOffset + length);
+						sourceOffset += length;
+						break;
+					}
+
+					case BPS::Action::TargetCopy: {
+						const u64 data = BPS::readRunLength<u64>(patch, patchOffset, patchSize);
+						const u64 offset = data >> 1;
+						outputOffset2 += (data & 1) ? -offset : +offset;
+
+						// We can only copy from the part of the output that's already been written
+						if (patchOffset > patchSize || outputOffset2 >= outputOffset) {
+							return Result::InvalidPatch;
+						}
+
+						push(Op::TargetCopy, length, outputOffset, outputOffset2);
+						outputOffset2 += length;
+						break;
+					}
+				}
+
+				outputOffset += length;
+			}
+
+			// Pad rest of the output with 0s
+			push(Op::Fill, outputSize - outputOffset, outputOffset, 0);
+			return Result::Success;
+		}
+
+		// Adds an operation writing the next "length" bytes of the output, merging it into the last one if it carries on from it
+		void append(Op op, u64 length, u64 source, u64 input = 0) {
+			if (length == 0) {
+				return;
+			}
+
+			const u64 target = expectedOutputSize;
+			expectedOutputSize += length;
+
+			if (!ops.empty() && ops.back() == op) {
+				const u64 last = lengths.back();
+				const bool continues = (op == Op::Fill) ? sources.back() == source
+														: sources.back() + last == source && (op != Op::Xor || xorInputs.back() + last == input);
+
+				if (continues) {
+					lengths.back() += length;
+					return;
+				}
+			}
+
+			push(op, length, target, source);
+			xorInputs.push_back(op == Op::Xor ? input : target);
+		}
+
+		// Calls emit(op, length, source, input) with operations that write bytes [begin, end) of our output, in order, to
+		// "outputOffset" of another output. Past the end of our output that's 0s, the same as the patchers read past the end of
+		// their input. TargetCopies are followed back to what they copy, except that once the pattern of one that repeats
+		// itself has been written, the rest of it is copied from there, unless "expand" is set
+		template <typename Emit>
+		void resolve(u64 begin, u64 end, u64 outputOffset, bool expand, Emit&& emit) const {
+			struct Span {
+				u64 begin;
+				u64 end;
+				u64 period;  // If not 0, a TargetCopy of [begin, end) from "period" bytes back is written instead
+			};
+
+			// Followed TargetCopies get pushed on top of what comes after them, so deep chains of them don't use any stack
+			std::vector<Span> pending = {{begin, end, 0}};
+			u64 written = outputOffset;
+
+			while (!pending.empty()) {
+				const Span span = pending.back();
+				pending.pop_back();
+				const u64 length = span.end - span.begin;
+
+				if (length == 0) {
+					continue;
+				} else if (span.period != 0) {
+					emit(Op::TargetCopy, length, written - span.period, 0);
+					written += length;
+					continue;
+				} else if (span.begin >= expectedOutputSize) {
+					emit(Op::Fill, length, 0, 0);
+					written += length;
+					continue;
+				}
+
+				const usize i = usize(std::upper_bound(targets.begin(), targets.end(), span.begin) - targets.begin()) - 1;
+				const u64 offset = span.begin - targets[i];
+				const u64 pieceEnd = std::min<u64>(span.end, targets[i] + lengths[i]);
+				const u64 pieceLength = pieceEnd - span.begin;
+				pending.push_back({pieceEnd, span.end, 0});
+
+				switch (ops[i]) {
+					case Op::Copy: emit(Op::Copy, pieceLength, sources[i] + offset, 0); break;
+					case Op::Literal: emit(Op::Literal, pieceLength, sources[i] + offset, 0); break;
+					case Op::Fill: emit(Op::Fill, pieceLength, sources[i], 0); break;
+					case Op::Xor: emit(Op::Xor, pieceLength, sources[i] + offset, xorInput(i) + offset); break;
+
+					case Op::TargetCopy: {
+						// Byte n of a TargetCopy is byte n % period of what it copies, which is only more than once if it
+						// overlaps its own output
+						const u64 period = targets[i] - sources[i];
+						const u64 phase = offset % period;
+
+						if (!expand && pieceLength > period) {
+							pending.push_back({span.begin + period, pieceEnd, period});
+							pending.push_back({span.begin, span.begin + period, 0});
+						} else {
+							const u64 chunk = std::min<u64>(pieceLength, period - phase);
+							pending.push_back({span.begin + chunk, pieceEnd, 0});
+							pending.push_back({sources[i] + phase, sources[i] + phase + chunk, 0});
+						}
+
+						continue;
+					}
+				}
+
+				written += pieceLength;
+			}
+		}
+
+		// Replaces the output so far with "layer" applied on top of it. Literals stay in our storage, as the operations that
+		// use them are only ever moved around
+		void fold(const CompiledPatch& layer) {
+			CompiledPatch next;
+			next.literals = std::move(literals);
+			next.reserve(layer.ops.size());
+
+			const CompiledPatch flat = layer.type == PatchType::IPS ? layer.flattened() : CompiledPatch();
+			const CompiledPatch& source = layer.type == PatchType::IPS ? flat : layer;
+			const u8* layerLiterals = source.literalData();
+			const auto appendNext = [&](Op op, u64 length, u64 from, u64 input) { next.append(op, length, from, input); };
+
+			for (usize i = 0; i < source.ops.size(); i++) {
+				const u64 length = source.lengths[i];
+				const u64 from = source.sources[i];
+
+				switch (source.ops[i]) {
+					case Op::Copy: resolve(from, from + length, next.expectedOutputSize, false, appendNext); break;
+					case Op::Fill: next.append(Op::Fill, length, from); break;
+					case Op::TargetCopy: next.append(Op::TargetCopy, length, from); break;
+
+					case Op::Literal:
+						next.literals.insert(next.literals.end(), layerLiterals + from, layerLiterals + from + length);
+						next.append(Op::Literal, length, next.literals.size() - length);
+						break;
+
+					// What the XOR is applied to can be anything by now, so it's split up into the pieces it's made of, and the
+					// ones that don't come from the input are XORed into new literals
+					case Op::Xor: {
+						const u8* patch = layerLiterals + from;
+						const u64 input = source.xorInput(i);
+
+						resolve(input, input + length, 0, true, [&](Op op, u64 pieceLength, u64 pieceSource, u64 pieceInput) {
+							const usize start = next.literals.size();
+							next.literals.resize(start + usize(pieceLength));
+							u8* xored = next.literals.data() + start;
+
+							if (op == Op::Copy || op == Op::Xor) {
+								const u8* previous = op == Op::Xor ? next.literals.data() + pieceSource : nullptr;
+								for (usize j = 0; j < pieceLength; j++) {
+									xored[j] = patch[j] ^ (previous != nullptr ? previous[j] : 0);
+								}
+
+								next.append(Op::Xor, pieceLength, start, op == Op::Xor ? pieceInput : pieceSource);
+							} else {
+								const u8* previous = op == Op::Literal ? next.literals.data() + pieceSource : nullptr;
+								for (usize j = 0; j < pieceLength; j++) {
+									xored[j] = patch[j] ^ (previous != nullptr ? previous[j] : u8(pieceSource));
+								}
+
+								next.append(Op::Literal, pieceLength, start);
+							}
+
+							patch += pieceLength;
+						});
+
+						break;
+					}
+				}
+			}
+
+			ops = std::move(next.ops);
+			lengths = std::move(next.lengths);
+			targets = std::move(next.targets);
+			sources = std::move(next.sources);
+			xorInputs = std::move(next.xorInputs);
+			literals = std::move(next.literals);
+			expectedOutputSize = next.expectedOutputSize;
+		}
+
+		// The records of an IPS patch cut down to the parts of them that make it to the output, in output order, with copies
+		// of the input in between. Literals are borrowed from this patch
+		CompiledPatch flattened() const {
+			CompiledPatch flat;
+			flat.type = PatchType::BPS;
+			flat.borrowedLiterals = literalData();
+			flat.inputSize = inputSize;
+			flat.expectedOutputSize = expectedOutputSize;
+			flat.minimumInputSize = minimumInputSize;
+
+			// Where every piece of a record that's still showing starts, with where it ends and which record it's from
+			std::map<u64, std::pair<u64, usize>> pieces;
+			for (usize i = 1; i < ops.size(); i++) {
+				const u64 begin = targets[i];
+				const u64 end = begin + lengths[i];
+				auto next = pieces.lower_bound(begin);
+
+				// Cut what this record writes over out of the pieces it overlaps, keeping what's left on either side
+				if (next != pieces.begin() && std::prev(next)->second.first > begin) {
+					auto& [pieceEnd, record] = std::prev(next)->second;
+					if (pieceEnd > end) {
+						pieces.emplace(end, std::pair(pieceEnd, record));
+					}
+
+					pieceEnd = begin;
+				}
+
+				while (next != pieces.end() && next->first < end) {
+					if (next->second.first > end) {
+						pieces.emplace(end, next->second);
+					}
+
+					next = pieces.erase(next);
+				}
+
+				pieces.emplace(begin, std::pair(end, i));
+			}
+
+			u64 offset = 0;
+			for (const auto& [begin, piece] : pieces) {
+				const auto [end, record] = piece;
+				const u64 skipped = ops[record] == Op::Literal ? begin - targets[record] : 0;
+
+				flat.push(Op::Copy, begin - offset, offset, offset);
+				flat.push(ops[record], end - begin, begin, sources[record] + skipped);
+				offset = end;
+			}
+
+			flat.push(Op::Copy, expectedOutputSize - offset, offset, offset);
+			return flat;
+		}
+
+		// Drops the literals that nothing uses anymore, which folding leaves behind when later patches write over earlier ones
+		void compactLiterals() {
+			std::vector<u8> used;
+			for (usize i = 0; i < ops.size(); i++) {
+				if (ops[i] == Op::Literal || ops[i] == Op::Xor) {
+					used.insert(used.end(), literals.begin() + usize(sources[i]), literals.begin() + usize(sources[i] + lengths[i]));
+					sources[i] = used.size() - lengths[i];
+				}
+			}
+
+			literals = std::move(used);
+		}
+	};
+
+	// Applies a chain of patches one after the other, in a single pass over the output instead of one per patch. Patches
+	// that get applied together a lot are better off composed once with CompiledPatch::compose, which is what this does
+	template <typename Allocator = std::allocator<u8>>
+	static std::pair<std::vector<u8, Allocator>, Result> patchChain(
+		const u8* data, usize dataSize, std::span<const ChainedPatch> patches, Verification verification = Verification::Eager
+	) {
+		auto [composed, result] = CompiledPatch::compose(patches);
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		return composed.template apply<Allocator>(data, dataSize, verification);
+	}
+
+	// One patch to apply as part of a batch
+	struct BatchJob {
+		const u8* data;
+		usize dataSize;
+		const u8* patch;
+		usize patchSize;
+		PatchType type;
+	};
+
+	// Applies a batch of patches on a thread pool, with the results in the same order as the jobs
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>>
+	static std::vector<std::pair<std::vector<u8, Allocator>, Result>> patchBatch(
+		ThreadPool& pool, std::span<const BatchJob> jobs, Verification verification = Verification::Eager
+	) {
+		std::vector<std::pair<std::vector<u8, Allocator>, Result>> results(jobs.size());
+		pool.run(jobs.size(), [&](usize index, usize /* worker */) {
+			const BatchJob& job = jobs[index];
+			results[index] = patch<Policy, Allocator>(job.data, job.dataSize, job.patch, job.patchSize, job.type, verification);
+		});
+
+		return results;
+	}
+
+	// Same as above, but instead of allocating an output for every job, each worker patches into a buffer it reuses for all
+	// of its jobs and hands it to onResult(index, output, result) on the worker thread. The output is only valid during the
+	// call, so whatever needs to be kept (eg a hash, or the bytes written out to a file) has to be taken from it there
+	template <typename Policy = ReadPolicy::Checked, typename Callback>
+	static void patchBatch(
+		ThreadPool& pool, std::span<const BatchJob> jobs, Callback&& onResult, Verification verification = Verification::Eager
+	) {
+		std::vector<std::vector<u8, DefaultInitAllocator<u8>>> buffers(pool.threadCount());
+
+		pool.run(jobs.size(), [&](usize index, usize worker) {
+			const BatchJob& job = jobs[index];
+			auto [outputSize, result] = queryOutputSize<Policy>(job.patch, job.patchSize, job.type);
+
+			if (result != Result::Success) {
+				onResult(index, std::span<const u8>(), result);
+				return;
+			}
+
+			// Buffers only ever grow, so after the largest output a worker has seen, patching doesn't allocate anymore
+			auto& buffer = buffers[worker];
+			if (buffer.size() < outputSize) {
+				buffer.resize(outputSize);
+			}
+
+			const std::span<u8> output(buffer.data(), outputSize);
+			result = patchInto<Policy>(output, job.data, job.dataSize, job.patch, job.patchSize, job.type, verification);
+			onResult(index, std::span<const u8>(output), result);
+		});
+	}
+
+	// Same as patchIPS, but the records are decoded up front and applied in parallel on "pool", with the output split into
+	// stripes. Records still get applied in order within each stripe, so overlapping records give the same result
+	template <typename Allocator = std::allocator<u8>>
+	static std::pair<std::vector<u8, Allocator>, Result> patchIPS(ThreadPool& pool, const u8* data, usize dataSize, const u8* patch, usize patchSize) {
+		auto [compiled, result] = CompiledPatch::compile(patch, patchSize, PatchType::IPS, CompiledPatch::Literals::Borrow);
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		return compiled.apply<Allocator>(data, dataSize, pool);
+	}
+
+	// Same as patchBPS, but the patch is decoded up front so that its actions can be applied in parallel on "pool". Worth it
+	// for large outputs, for which it cuts down the time to patch a single file instead of just patching more files at once
+	template <typename Allocator = std::allocator<u8>>
+	static std::pair<std::vector<u8, Allocator>, Result> patchBPS(
+		ThreadPool& pool, const u8* data, usize dataSize, const u8* patch, usize patchSize, Verification verification = Verification::Eager
+	) {
+		auto [compiled, result] = CompiledPatch::compile(patch, patchSize, PatchType::BPS, CompiledPatch::Literals::Borrow);
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		return compiled.apply<Allocator>(data, dataSize, pool, verification);
+	}
+
+	namespace BPS {
+		// How hard the encoder looks for matches, picked from the compression level passed to createBPS
+		struct EncoderSettings {
+			usize sourceStride;  // Only every sourceStride-th position of the source is indexed
+			usize targetStride;  // Same for positions of the target, for TargetCopy
+			usize searchDepth;   // How many indexed source positions with the same hash get compared
+			usize niceLength;    // Matches at least this long are taken without looking for longer ones
+			usize skipShift;     // Searches without a match before the encoder starts skipping ahead, as a power of 2
+			bool lazyMatching;   // Whether to check if starting a match 1 byte later gives a longer one
+		};
+
+		static constexpr u32 minimumLevel = 1;
+		static constexpr u32 maximumLevel = 9;
+		static constexpr u32 defaultLevel = 6;
+
+		static EncoderSettings encoderSettings(u32 level) {
+			level = std::clamp(level, minimumLevel, maximumLevel);
+			constexpr usize strides[] = {16, 16, 8, 8, 4, 4, 2, 2, 1};
+			constexpr usize depths[] = {1, 2, 2, 4, 4, 8, 16, 32, 64};
+			constexpr usize niceLengths[] = {32, 32, 64, 64, 256, 256, 1024, 1024, 4096};
+			constexpr usize skipShifts[] = {4, 4, 5, 5, 6, 6, 8, 8, 10};
+
+			return {strides[level - 1], level <= 2 ? 4u : 1u, depths[level - 1], niceLengths[level - 1], skipShifts[level - 1], level >= 5};
+		}
+
+		// Matches are found by hashing this many bytes, so shorter matches are never used (they'd barely save anything anyway)
+		static constexpr usize minimumMatch = 8;
+
+		static inline u32 hashMatch(const u8* data, u32 bits) {
+			u64 word;
+			std::memcpy(&word, data, sizeof(word));
+			return u32((word * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+		}
+
+		// Runs task(index) for every index in [0, count), on the pool if there is one
+		template <typename Task>
+		static void forEach(ThreadPool* pool, usize count, Task&& task) {
+			if (pool != nullptr && count > 1) {
+				pool->run(count, [&](usize index, usize /* worker */) { task(index); });
+			} else {
+				for (usize index = 0; index < count; index++) {
+					task(index);
+				}
+			}
+		}
+
+		// Every sourceStride-th position of the source, grouped by the hash of the bytes there. Positions are stored divided by
+		// the stride so they fit in 32 bits, and are sorted within each bucket. The index is built with a parallel 2-pass
+		// radix sort: positions are first split by the top 8 bits of their hash, then every partition is sorted on its own
+		class SourceIndex {
+		  public:
+			SourceIndex(const u8* source, usize sourceSize, usize stride, ThreadPool* pool) : stride(stride) {
+				if (sourceSize < minimumMatch) {
+					return;
+				}
+
+				// Positions have to fit in 32 bits once divided by the stride
+				this->stride = std::max<usize>(stride, usize(((sourceSize - minimumMatch) >> 32) + 1));
+				const usize count = (sourceSize - minimumMatch) / this->stride + 1;
+				bits = std::clamp<u32>(u32(std::bit_width(count)), 12, 24);
+
+				const usize chunks = pool != nullptr ? std::clamp<usize>(count / 65536, 1, pool->threadCount() * 4) : 1;
+				const auto chunkStart = [&](usize chunk) { return count * chunk / chunks; };
+				const auto partitionOf = [&](u32 hash) { return hash >> (bits - 8); };
+
+				// Pass 1: hash every position and count how many of each chunk go in each partition
+				std::vector<u32> hashes(count);
+				std::vector<std::array<u32, 256>> partitionCounts(chunks);
+				forEach(pool, chunks, [&](usize chunk) {
+					auto& counts = partitionCounts[chunk];
+					counts.fill(0);
+
+					for (usize i = chunkStart(chunk); i < chunkStart(chunk + 1); i++) {
+						hashes[i] = hashMatch(source + i * this->stride, bits);
+						counts[partitionOf(hashes[i])]++;
+					}
+				});
+
+				// Each chunk scatters its positions to its own part of every partition, so the scatter needs no locking and the
+				// positions stay in order
+				std::array<u32, 257> partitionStarts{};
+				std::vector<std::array<u32, 256>> scatterOffsets(chunks);
+				u32 offset = 0;
+				for (usize partition = 0; partition < 256; partition++) {
+					partitionStarts[partition] = offset;
+					for (usize chunk = 0; chunk < chunks; chunk++) {
+						scatterOffsets[chunk][partition] = offset;
+						offset += partitionCounts[chunk][partition];
+					}
+				}
+				partitionStarts[256] = offset;
+
+				std::vector<u32> partitioned(count);
+				forEach(pool, chunks, [&](usize chunk) {
+					auto& offsets = scatterOffsets[chunk];
+					for (usize i = chunkStart(chunk); i < chunkStart(chunk + 1); i++) {
+						partitioned[offsets[partitionOf(hashes[i])]++] = u32(i);
+					}
+				});
+
+				// Pass 2: counting sort of every partition by the rest of the hash
+				const usize bucketsPerPartition = usize(1) << (bits - 8);
+				bucketStarts.assign((usize(1) << bits) + 1, 0);
+				positions.resize(count);
+
+				forEach(pool, 256, [&](usize partition) {
+					u32* starts = &bucketStarts[partition * bucketsPerPartition];
+					const u32 begin = partitionStarts[partition];
+					const u32 end = partitionStarts[partition + 1];
+
+					for (u32 i = begin; i < end; i++) {
+						starts[hashes[partitioned[i]] & (bucketsPerPartition - 1)]++;
+					}
+
+					u32 bucketOffset = begin;
+					for (usize bucket = 0; bucket < bucketsPerPartition; bucket++) {
+						const u32 bucketCount = starts[bucket];
+						starts[bucket] = bucketOffset;
+						bucketOffset += bucketCount;
+					}
+
+					// Fill buckets from the back, using the next bucket's start (which is already in place) as the end
+					std::vector<u32> next(starts, starts + bucketsPerPartition);
+					for (u32 i = begin; i < end; i++) {
+						positions[next[hashes[partitioned[i]] & (bucketsPerPartition - 1)]++] = partitioned[i];
+					}
+				});
+
+				bucketStarts.back() = u32(count);
+			}
+
+			bool empty() const { return positions.empty(); }
+			usize positionStride() const { return stride; }
+
+			// Indexed positions (divided by the stride) whose bytes hash the same as "data"
+			std::span<const u32> lookup(const u8* data) const {
+				const u32 hash = hashMatch(data, bits);
+				return std::span<const u32>(positions.data() + bucketStarts[hash], bucketStarts[hash + 1] - bucketStarts[hash]);
+			}
+
+		  private:
+			usize stride;
+			u32 bits = 0;
+			std::vector<u32> bucketStarts;
+			std::vector<u32> positions;
+		};
+
+		// Greedy (optionally lazy) matcher producing all 4 kinds of actions. At each target position it looks for the longest
+		// of a SourceRead (same offset in the source), a SourceCopy (anywhere in the source, through the index) and a TargetCopy
+		// (anywhere earlier in the target, through a hash table of the most recent position for every hash)
+		class Encoder {
+		  public:
+			Encoder(const u8* source, usize sourceSize, const u8* target, usize targetSize, u32 level, ThreadPool* pool)
+				: source(source), sourceSize(sourceSize), target(target), targetSize(targetSize), settings(encoderSettings(level)),
+				  index(source, sourceSize, settings.sourceStride, pool), pool(pool) {
+				targetBits = std::clamp<u32>(u32(std::bit_width(targetSize / settings.targetStride)), 12, 24);
+				targetHeads.assign(usize(1) << targetBits, noPosition);
+			}
+
+			std::vector<u8> encode() {
+				std::vector<u8> out = {'B', 'P', 'S', '1'};
+				Detail::writeRunLength(out, sourceSize);
+				Detail::writeRunLength(out, targetSize);
+				Detail::writeRunLength(out, 0);  // No metadata
+
+				usize position = 0;
+				usize literalStart = 0;
+				usize misses = 0;  // Searches in a row that didn't find a match
+
+				while (position + minimumMatch <= targetSize) {
+					Match match = findMatch(position);
+
+					if (settings.lazyMatching && match.length >= minimumMatch && match.length < settings.niceLength &&
+						position + 1 + minimumMatch <= targetSize) {
+						const Match next = findMatch(position + 1);
+						if (next.length > match.length + 1) {
+							position++;
+							match = next;
+						}
+					}
+
+					// Data that doesn't match anything gets searched less and less often the longer it goes on, like LZ4 does, as
+					// searching every byte of it is slow. The positions skipped over aren't indexed either
+					if (match.length < minimumMatch) {
+						const usize step = 1 + (misses++ >> settings.skipShift);
+						position += step;
+						if (step > 1) {
+							targetIndexed = std::max(targetIndexed, position - 1);
+						}
+
+						continue;
+					}
+
+					misses = 0;
+
+					// The match might start before the position we found it at, eat into the literals before it if so
+					while (position > literalStart && match.from > 0 && matchByte(match, match.from - 1) == target[position - 1]) {
+						position--;
+						match.from--;
+						match.length++;
+					}
+
+					writeLiterals(out, literalStart, position);
+					writeMatch(out, position, match);
+					position += match.length;
+					literalStart = position;
+
+					// Indexing every position inside long matches costs a lot of cache misses for little gain, as their bytes
+					// can usually be matched again the same way they were here. Only the end of them gets indexed
+					if (match.length >= settings.niceLength) {
+						targetIndexed = std::max(targetIndexed, position - minimumMatch);
+					}
+				}
+
+				writeLiterals(out, literalStart, targetSize);
+
+				const u32 sourceCRC = pool != nullptr ? crc32(*pool, source, sourceSize) : Detail::crc32(source, sourceSize);
+				const u32 targetCRC = pool != nullptr ? crc32(*pool, target, targetSize) : Detail::crc32(target, targetSize);
+				Detail::writeLE32(out, sourceCRC);
+				Detail::writeLE32(out, targetCRC);
+				Detail::writeLE32(out, Detail::crc32(out.data(), out.size()));
+				return out;
+			}
+
+		  private:
+			static constexpr u64 noPosition = ~u64(0);
+
+			struct Match {
+				u32 action;
+				usize from;  // Where the match is in the source (SourceRead/SourceCopy) or the target (TargetCopy)
+				usize length;
+			};
+
+			const u8* source;
+			usize sourceSize;
+			const u8* target;
+			usize targetSize;
+			EncoderSettings settings;
+			SourceIndex index;
+			ThreadPool* pool;
+
+			std::vector<u64> targetHeads;
+			u32 targetBits;
+			usize targetIndexed = 0;  // Target positions before this one are in targetHeads
+
+			u64 sourceRelativeOffset = 0;
+			u64 targetRelativeOffset = 0;
+
+			u8 matchByte(const Match& match, usize offset) const {
+				return match.action == Action::TargetCopy ? target[offset] : source[offset];
+			}
+
+			Match findMatch(usize position) {
+				const usize remaining = targetSize - position;
+				const u8* wanted = target + position;
+				Match best = {Action::TargetRead, 0, 0};
+
+				// SourceRead is the cheapest action to encode, so other matches have to be strictly longer to beat it
+				if (position < sourceSize) {
+					best = {Action::SourceRead, position, Detail::matchLength(source + position, wanted, std::min(remaining, sourceSize - position))};
+				}
+
+				if (!index.empty() && best.length < settings.niceLength) {
+					// Check the indexed positions closest to where the last SourceCopy left off first, as copies tend to follow
+					// each other and nearby offsets are cheaper to encode
+					const std::span<const u32> candidates = index.lookup(wanted);
+					const usize stride = index.positionStride();
+					const u64 expected = sourceRelativeOffset / stride;
+					const usize middle = usize(std::lower_bound(candidates.begin(), candidates.end(), expected) - candidates.begin());
+					const usize depth = std::min(candidates.size(), settings.searchDepth);
+					const usize first = std::min(middle - std::min(middle, depth / 2), candidates.size() - depth);
+
+					for (usize i = first; i < first + depth && best.length < settings.niceLength; i++) {
+						const usize from = usize(candidates[i]) * stride;
+						const usize available = std::min(remaining, sourceSize - from);
+
+						// Only worth comparing if the candidate could be longer than the best match so far
+						if (available <= best.length || source[from + best.length] != wanted[best.length]) {
+							continue;
+						}
+
+						const usize length = Detail::matchLength(source + from, wanted, available);
+						if (length > best.length) {
+							best = {Action::SourceCopy, from, length};
+						}
+					}
+				}
+
+				// Index the target up to here, then look for the most recent earlier position with the same hash. The copy is
+				// allowed to run into the bytes it writes, which is how BPS encodes repeating patterns
+				for (; targetIndexed < position && targetIndexed + minimumMatch <= targetSize; targetIndexed += settings.targetStride) {
+					targetHeads[hashMatch(target + targetIndexed, targetBits)] = targetIndexed;
+				}
+
+				const u64 from = targetHeads[hashMatch(wanted, targetBits)];
+				if (from != noPosition && from < position && best.length < settings.niceLength) {
+					const usize length = Detail::matchLength(target + from, wanted, remaining);
+					if (length > best.length) {
+						best = {Action::TargetCopy, usize(from), length};
+					}
+				}
+
+				return best;
+			}
+
+			void writeLiterals(std::vector<u8>& out, usize begin, usize end) {
+				if (begin == end) {
+					return;
+				}
+
+				Detail::writeRunLength(out, (u64(end - begin - 1) << 2) | Action::TargetRead);
+				out.insert(out.end(), target + begin, target + end);
+			}
+
+			static void writeRelativeOffset(std::vector<u8>& out, u64& relativeOffset, u64 offset) {
+				const bool negative = offset < relativeOffset;
+				const u64 distance = negative ? relativeOffset - offset : offset - relativeOffset;
+				Detail::writeRunLength(out, (distance << 1) | (negative ? 1 : 0));
+			}
+
+			void writeMatch(std::vector<u8>& out, usize position, const Match& match) {
+				// A SourceCopy that ended up at the same offset as the output (after extending it backwards) is a SourceRead
+				const u32 action = (match.action == Action::SourceCopy && match.from == position) ? u32(Action::SourceRead) : match.action;
+				Detail::writeRunLength(out, (u64(match.length - 1) << 2) | action);
+
+				if (action == Action::SourceCopy) {
+					writeRelativeOffset(out, sourceRelativeOffset, match.from);
+					sourceRelativeOffset = match.from + match.length;
+				} else if (action == Action::TargetCopy) {
+					writeRelativeOffset(out, targetRelativeOffset, match.from);
+					targetRelativeOffset = match.from + match.length;
+				}
+			}
+		};
+	}  // namespace BPS
+
+	// Creates a BPS patch that turns "source" into "target". Higher levels (BPS::minimumLevel to BPS::maximumLevel) look
+	// harder for matches, which makes smaller patches but takes longer
+	static inline std::vector<u8> createBPS(const u8* source, usize sourceSize, const u8* target, usize targetSize, u32 level = BPS::defaultLevel) {
+		return BPS::Encoder(source, sourceSize, target, targetSize, level, nullptr).encode();
+	}
+
+	// Same as above, but the index of the source and the checksums are built on "pool"
+	static inline std::vector<u8> createBPS(
+		ThreadPool& pool, const u8* source, usize sourceSize, const u8* target, usize targetSize, u32 level = BPS::defaultLevel
+	) {
+		return BPS::Encoder(source, sourceSize, target, targetSize, level, &pool).encode();
+	}
+
+	namespace Detail {
+		// Scans target[offset, end) for the first byte that's the same as (findEqual = true) or different from (false) the
+		// source, with the source padded with 0s past its end the way the IPS and UPS patchers read it. Returns how many bytes
+		// come before it
+		template <bool findEqual>
+		static usize scanPadded(const u8* source, usize sourceSize, const u8* target, usize offset, usize end) {
+			const auto scan = findEqual ? differenceLength : matchLength;
+			usize position = offset;
+
+			if (position < sourceSize) {
+				const usize sourceEnd = std::min(sourceSize, end);
+				position += scan(source + position, target + position, sourceEnd - position);
+				if (position < sourceEnd) {
+					return position - offset;
+				}
+			}
+
+			static constexpr std::array<u8, 4096> zeros{};
+			while (position < end) {
+				const usize chunk = std::min<usize>(zeros.size(), end - position);
+				const usize length = scan(zeros.data(), target + position, chunk);
+				position += length;
+
+				if (length < chunk) {
+					break;
+				}
+			}
+
+			return position - offset;
+		}
+	}  // namespace Detail
+
+	// Creates a UPS patch that turns "source" into "target", with one XOR run for every stretch of bytes that changed
+	static inline std::vector<u8> createUPS(const u8* source, usize sourceSize, const u8* target, usize targetSize) {
+		std::vector<u8> out = {'U', 'P', 'S', '1'};
+		Detail::writeRunLength(out, sourceSize);
+		Detail::writeRunLength(out, targetSize);
+
+		usize position = 0;
+		while (position < targetSize) {
+			const usize same = Detail::scanPadded<false>(source, sourceSize, target, position, targetSize);
+			if (position + same == targetSize) {
+				break;
+			}
+
+			Detail::writeRunLength(out, same);
+			position += same;
+
+			// The run is the XOR of the changed bytes, followed by a 0 which gets XORed with the next byte that didn't change
+			const usize different = Detail::scanPadded<true>(source, sourceSize, target, position, targetSize);
+			const usize runStart = out.size();
+			out.resize(runStart + different + 1);
+
+			u8* run = out.data() + runStart;
+			const usize xored = position < sourceSize ? std::min(different, sourceSize - position) : 0;
+			for (usize i = 0; i < xored; i++) {
+				run[i] = source[position + i] ^ target[position + i];
+			}
+
+			std::memcpy(run + xored, target + position + xored, different - xored);
+			run[different] = 0;
+			position += different + 1;
+		}
+
+		Detail::writeLE32(out, Detail::crc32(source, sourceSize));
+		Detail::writeLE32(out, Detail::crc32(target, targetSize));
+		Detail::writeLE32(out, Detail::crc32(out.data(), out.size()));
+		return out;
+	}
+
+	namespace IPS {
+		// IPS offsets are 3 bytes, and record sizes 2
+		static constexpr usize maximumOffset = 0xFFFFFF;
+		static constexpr usize maximumRecordSize = 0xFFFF;
+		// Changed bytes with at most this many unchanged ones between them go in the same record, as starting a new record
+		// costs 5 bytes of header
+		static constexpr usize mergeDistance = 5;
+		// Runs of the same byte at least this long get an RLE record, which costs 8 bytes plus 5 for the record after it
+		static constexpr usize minimumRunLength = 13;
+
+		class Encoder {
+		  public:
+			Encoder(const u8* target) : target(target) {}
+
+			// Returns false if the record would start past where IPS offsets can reach
+			bool writeLiterals(usize offset, usize size) {
+				while (size > 0) {
+					// A record can't start at the offset that reads as "EOF", so it starts 1 byte earlier instead. Writing that
+					// byte again with what it's meant to be doesn't change anything
+					const bool moved = offset == endOfFile;
+					const usize start = moved ? offset - 1 : offset;
+					const usize chunk = std::min<usize>(size, maximumRecordSize - (moved ? 1 : 0));
+					const usize length = chunk + (moved ? 1 : 0);
+
+					if (!writeHeader(start)) {
+						return false;
+					}
+
+					writeBE(length, 2);
+					out.insert(out.end(), target + start, target + start + length);
+					end = std::max(end, start + length);
+					offset += chunk;
+					size -= chunk;
+				}
+
+				return true;
+			}
+
+			bool writeRun(usize offset, usize size) {
+				while (size > 0) {
+					// See above, the byte before the run and its first byte become a literal record
+					if (offset == endOfFile) {
+						if (!writeLiterals(offset, 1)) {
+							return false;
+						}
+
+						offset++;
+						size--;
+						continue;
+					}
+
+					const usize chunk = std::min(size, maximumRecordSize);
+					if (!writeHeader(offset)) {
+						return false;
+					}
+
+					writeBE(0, 2);
+					writeBE(chunk, 2);
+					out.push_back(target[offset]);
+					end = std::max(end, offset + chunk);
+					offset += chunk;
+					size -= chunk;
+				}
+
+				return true;
+			}
+
+			// Splits changed bytes into literal and RLE records
+			bool writeRegion(usize begin, usize regionEnd) {
+				usize literalStart = begin;
+				usize position = begin;
+
+				while (position < regionEnd) {
+					usize run = 1;
+					while (position + run < regionEnd && target[position + run] == target[position]) {
+						run++;
+					}
+
+					if (run >= minimumRunLength) {
+						if (!writeLiterals(literalStart, position - literalStart) || !writeRun(position, run)) {
+							return false;
+						}
+
+						literalStart = position + run;
+					}
+
+					position += run;
+				}
+
+				return writeLiterals(literalStart, regionEnd - literalStart);
+			}
+
+			// patchIPS makes the patched file as large as the furthest any record goes, while patchIPSInPlace and most other
+			// tools keep the size of the source, so the target's size goes in the footer after EOF unless both agree on it.
+			// Targets too large for the footer get a record covering their last byte instead, which can't make them shorter
+			// than the source though
+			bool finish(usize targetSize, usize sourceSize) {
+				const bool shrinks = targetSize < sourceSize;
+				bool footer = false;
+
+				if (end < targetSize || shrinks) {
+					if (targetSize <= maximumOffset) {
+						footer = true;
+					} else {
+						const usize offset = std::min(targetSize - 1, maximumOffset);
+						if (shrinks || targetSize - offset > maximumRecordSize || !writeLiterals(offset, targetSize - offset)) {
+							return false;
+						}
+					}
+				}
+
+				out.insert(out.end(), {'E', 'O', 'F'});
+				if (footer) {
+					writeBE(targetSize, 3);
+				}
+
+				return true;
+			}
+
+			std::vector<u8> out = {'P', 'A', 'T', 'C', 'H'};
+
+		  private:
+			const u8* target;
+			usize end = 0;  // How far into the file the records go
+
+			void writeBE(usize value, usize size) {
+				for (usize i = size; i > 0; i--) {
+					out.push_back(u8(value >> ((i - 1) * CHAR_BIT)));
+				}
+			}
+
+			bool writeHeader(usize offset) {
+				if (offset > maximumOffset) {
+					return false;
+				}
+
+				writeBE(offset, 3);
+				return true;
+			}
+		};
+	}  // namespace IPS
+
+	// Creates an IPS patch that turns "source" into "target". IPS can only address the first 16 MiB of a file, so targets
+	// that differ from the source past that (or that are larger than that plus a record, or shorter than a source that's larger
+	// than that) give SizeMismatch
+	static inline std::pair<std::vector<u8>, Result> createIPS(const u8* source, usize sourceSize, const u8* target, usize targetSize) {
+		IPS::Encoder encoder(target);
+		usize position = 0;
+
+		while (true) {
+			position += Detail::scanPadded<false>(source, sourceSize, target, position, targetSize);
+			if (position >= targetSize) {
+				break;
+			}
+
+			// Find where the changes end, going past short stretches of unchanged bytes
+			usize regionEnd = position;
+			while (true) {
+				regionEnd += Detail::scanPadded<true>(source, sourceSize, target, regionEnd, targetSize);
+				const usize gapEnd = std::min(targetSize, regionEnd + IPS::mergeDistance + 1);
+				const usize gap = Detail::scanPadded<false>(source, sourceSize, target, regionEnd, gapEnd);
+
+				if (gap > IPS::mergeDistance || regionEnd + gap == targetSize) {
+					break;
+				}
+
+				regionEnd += gap;
+			}
+
+			if (!encoder.writeRegion(position, regionEnd)) {
+				return {{}, Result::SizeMismatch};
+			}
+
+			position = regionEnd;
+		}
+
+		if (!encoder.finish(targetSize, sourceSize)) {
+			return {{}, Result::SizeMismatch};
+		}
+
+		return {std::move(encoder.out), Result::Success};
+	}
+
+	// Streaming versions of the patchers, for files too large to keep in memory. The input, the patch and the output are
+	// accessed through the Source and Sink interfaces below in chunks, so memory use is bounded by Stream::Options no matter
+	// how large the files are
+	namespace Stream {
+		// Something we can read bytes from at any offset, eg a file or a memory buffer
+		class Source {
+		  public:
+			virtual ~Source() = default;
+			virtual u64 size() const = 0;
+			// Reads "length" bytes starting at "offset" into dest. Returns false on failure
+			virtual bool read(u64 offset, u8* dest, usize length) = 0;
+		};
+
+		// Where the patched file goes. IPS writes records at arbitrary offsets, UPS and BPS write front to back
+		class Sink {
+		  public:
+			virtual ~Sink() = default;
+			// Writes "length" bytes at "offset", growing the output if needed. Returns false on failure
+			virtual bool write(u64 offset, const u8* data, usize length) = 0;
+
+			// Reads back output that has already been written. BPS needs this for TargetCopy actions that copy from further
+			// back than the output window, sinks that can't support it (eg pipes) can leave it as is
+			virtual bool read(u64 /* offset */, u8* /* dest */, usize /* length */) { return false; }
+		};
+
+		class MemorySource : public Source {
+			const u8* data;
+			usize dataSize;
+
+		  public:
+			MemorySource(const u8* data, usize size) : data(data), dataSize(size) {}
+			u64 size() const override { return dataSize; }
+
+			bool read(u64 offset, u8* dest, usize length) override {
+				if (offset > dataSize || length > dataSize - offset) {
+					return false;
+				}
+
+				std::memcpy(dest, data + offset, length);
+				return true;
+			}
+		};
+
+		class VectorSink : public Sink {
+			std::vector<u8>& output;
+
+		  public:
+			VectorSink(std::vector<u8>& output) : output(output) {}
+
+			bool write(u64 offset, const u8* data, usize length) override {
+				if (offset + length > output.size()) {
+					output.resize(offset + length);
+				}
+
+				std::memcpy(output.data() + offset, data, length);
+				return true;
+			}
+
+			bool read(u64 offset, u8* dest, usize length) override {
+				if (offset > output.size() || length > output.size() - offset) {
+					return false;
+				}
+
+				std::memcpy(dest, output.data() + offset, length);
+				return true;
+			}
+		};
+
+		// Peak memory use is roughly 4 * chunkSize + windowSize
+		struct Options {
+			// How much of the input and the patch is read at a time
+			usize chunkSize = 64 * 1024;
+			// How much of the most recent output is kept in memory. BPS TargetCopy actions copying from within the window
+			// don't have to read the output back from the sink, so larger windows help patches with lots of them
+			usize windowSize = 1024 * 1024;
+		};
+	}  // namespace Stream
+
+	namespace Detail {
+		// Buffered reader over a Stream::Source. Reading forward goes through the buffer, and seeking keeps the buffer if the
+		// new offset is still inside it, so small reads close to each other don't each turn into a read from the source.
+		// The buffer holds 2 chunks, so that peeking a whole chunk always reads at least a chunk's worth of new data
+		class StreamReader {
+			// Smallest read we do after seeking somewhere outside the buffer. Reads after that double in size while we keep
+			// reading forward, so scattered reads (eg BPS SourceCopy) don't each pull in a whole buffer's worth of data
+			static constexpr usize minimumReadAhead = 4096;
+
+			Stream::Source& source;
+			std::vector<u8> buffer;
+			u64 bufferOffset = 0;  // Offset in the source of buffer[0]
+			usize position = 0;    // Current read position in the buffer
+			usize filled = 0;      // How much of the buffer holds valid data
+			usize readAhead;
+			u64 end;
+			bool error = false;
+
+		  public:
+			StreamReader(Stream::Source& source, usize chunkSize)
+				: source(source), buffer(2 * std::max<usize>(chunkSize, 64)), readAhead(buffer.size()), end(source.size()) {}
+
+			u64 offset() const { return bufferOffset + position; }
+			u64 size() const { return end; }
+			bool failed() const { return error; }
+			const u8* data() const { return buffer.data() + position; }
+
+			// Makes sure at least "count" bytes are buffered from the current offset, if that much is left in the source and
+			// fits in the buffer. Returns how many bytes are available at data()
+			usize peek(usize count) {
+				if (filled - position >= count) {
+					return filled - position;
+				}
+
+				// Move what's left to the front of the buffer and fill the rest
+				std::memmove(buffer.data(), buffer.data() + position, filled - position);
+				bufferOffset += position;
+				filled -= position;
+				position = 0;
+
+				const u64 left = end > bufferOffset + filled ? end - (bufferOffset + filled) : 0;
+				const usize toRead = usize(std::min<u64>({buffer.size() - filled, std::max<usize>(readAhead, count - filled), left}));
+				readAhead = std::min<usize>(readAhead * 2, buffer.size());
+
+				if (toRead != 0) {
+					if (!source.read(bufferOffset + filled, buffer.data() + filled, toRead)) {
+						error = true;
+						return filled;
+					}
+
+					filled += toRead;
+				}
+
+				return filled;
+			}
+
+			// Skips bytes that have already been peeked
+			void skip(usize count) { position += count; }
+
+			void seek(u64 offset) {
+				if (offset >= bufferOffset && offset <= bufferOffset + filled) {
+					position = usize(offset - bufferOffset);
+				} else {
+					bufferOffset = offset;
+					position = filled = 0;
+					readAhead = std::min<usize>(minimumReadAhead, buffer.size());
+				}
+			}
+
+			// Reads "length" bytes into dest, with anything past the end of the source reading as 0, like readBytes.
+			// Returns how many bytes actually came from the source
+			usize read(u8* dest, usize length) {
+				usize copied = 0;
+				while (copied < length) {
+					const usize available = std::min<usize>(peek(length - copied), length - copied);
+					if (available == 0) {
+						break;
+					}
+
+					std::memcpy(dest + copied, data(), available);
+					skip(available);
+					copied += available;
+				}
+
+				std::memset(dest + copied, 0, length - copied);
+				return copied;
+			}
+
+			// Returns false if the integer is cut off by the end of the source
+			bool readRunLength(u64& value) {
+				const usize available = peek(10);
+				usize offset = 0;
+
+				value = Detail::readRunLength<u64>(data(), offset, available);
+				if (offset > available) {
+					return false;
+				}
+
+				skip(offset);
+				return true;
+			}
+		};
+
+		// Buffered writer over a Stream::Sink for output that's written front to back. The most recent output is kept in
+		// a window so that BPS can copy from it, and the output checksum is computed as the window is flushed
+		class StreamWriter {
+			Stream::Sink& sink;
+			std::vector<u8> window;
+			usize keep;               // How much of the window to hold on to when it fills up
+			u64 windowOffset = 0;     // Offset in the output of window[0]
+			usize filled = 0;
+			Crc32 crc;
+			bool error = false;
+
+			void flush(usize count) {
+				if (!sink.write(windowOffset, window.data(), count)) {
+					error = true;
+				}
+
+				crc.update(window.data(), count);
+				std::memmove(window.data(), window.data() + count, filled - count);
+				windowOffset += count;
+				filled -= count;
+			}
+
+		  public:
+			StreamWriter(Stream::Sink& sink, usize windowSize, usize keep)
+				: sink(sink), window(std::max<usize>(windowSize, 64)), keep(std::min<usize>(keep, window.size() / 2)) {}
+
+			u64 offset() const { return windowOffset + filled; }
+			bool failed() const { return error; }
+			u32 checksum() const { return crc.value(); }
+
+			// Returns where the next bytes should be written and sets "room" to how many fit there, making room if needed.
+			// Bytes written there need to be committed afterwards
+			u8* reserve(usize& room) {
+				if (filled == window.size()) {
+					flush(filled - keep);
+				}
+
+				room = window.size() - filled;
+				return window.data() + filled;
+			}
+
+			void commit(usize count) { filled += count; }
+
+			void fill(u8 value, u64 length) {
+				while (length != 0) {
+					usize room;
+					u8* dest = reserve(room);
+					const usize count = usize(std::min<u64>(room, length));
+
+					std::memset(dest, value, count);
+					commit(count);
+					length -= count;
+				}
+			}
+
+			// Appends "length" bytes of output starting at "from", which has to be before the current offset.
+			// The 2 can overlap, in which case this repeats the pattern between them like copyForward
+			bool copyFromOutput(u64 from, u64 length) {
+				while (length != 0) {
+					usize room;
+					u8* dest = reserve(room);
+					usize count = usize(std::min<u64>(room, length));
+
+					if (from >= windowOffset) {
+						copyForward(dest, window.data() + (from - windowOffset), count);
+					} else {
+						// Anything before the window has already been flushed, so the sink can give it back to us
+						count = usize(std::min<u64>(count, windowOffset - from));
+						if (!sink.read(from, dest, count)) {
+							error = true;
+							return false;
+						}
+					}
+
+					commit(count);
+					from += count;
+					length -= count;
+				}
+
+				return true;
+			}
+
+			bool finish() {
+				flush(filled);
+				return !error;
+			}
+		};
+
+		static bool streamCRC32(Stream::Source& source, u64 length, std::vector<u8>& buffer, u32& crc) {
+			Crc32 checksum;
+			for (u64 offset = 0; offset < length;) {
+				const usize count = usize(std::min<u64>(buffer.size(), length - offset));
+				if (!source.read(offset, buffer.data(), count)) {
+					return false;
+				}
+
+				checksum.update(buffer.data(), count);
+				offset += count;
+			}
+
+			crc = checksum.value();
+			return true;
+		}
+
+		// Streaming equivalent of readChecksums + verifyChecksums
+		static Result verifyStreamChecksums(Stream::Source& input, u64 inputSize, Stream::Source& patch, Checksums& checksums, usize chunkSize) {
+			const u64 patchSize = patch.size();
+			u8 footer[12];
+
+			if (!patch.read(patchSize - 12, footer, sizeof(footer))) {
+				return Result::IOError;
+			}
+
+			checksums = readChecksums(footer, sizeof(footer));
+			std::vector<u8> buffer(chunkSize);
+			u32 inputCRC, patchCRC;
+
+			if (!streamCRC32(patch, patchSize - 4, buffer, patchCRC) || !streamCRC32(input, inputSize, buffer, inputCRC)) {
+				return Result::IOError;
+			}
+
+			return (patchCRC == checksums.patch && inputCRC == checksums.input) ? Result::Success : Result::ChecksumMismatch;
+		}
+	}  // namespace Detail
+
+	namespace Stream {
+		// Same as Hips::patchIPS. The patch is read twice, once to figure out the output size and once to apply it, while
+		// the input is copied to the output once and the records are then written on top of it
+		static Result patchIPS(Source& input, Source& patch, Sink& output, const Options& options = {}) {
+			const u64 patchSize = patch.size();
+			if (patchSize < IPS::minimumPatchSize) {
+				return Result::InvalidPatch;
+			}
+
+			Detail::StreamReader reader(patch, options.chunkSize);
+			if (reader.peek(IPS::headerSize) < IPS::headerSize || std::memcmp(reader.data(), "PATCH", IPS::headerSize) != 0) {
+				return reader.failed() ? Result::IOError : Result::InvalidPatch;
+			}
+
+			// Records are at most 8 bytes before their data, so this is how much we need buffered to parse one
+			constexpr usize recordHeaderSize = 8;
+			u8 record[recordHeaderSize];
+			const auto readRecordField = [&](usize size) { return reader.read(record, size) == size; };
+			// A record that can't be read is cut short by the end of the patch, unless reading the patch failed
+			const auto readError = [&] { return reader.failed() ? Result::IOError : Result::InvalidPatch; };
+
+			// Walk the records once to find the output size, like IPS::getSize
+			u64 outputSize = 0;
+			reader.seek(IPS::headerSize);
+			while (reader.offset() < patchSize) {
+				if (!readRecordField(3)) {
+					return readError();
+				}
+
+				usize offset = 0;
+				const usize fileOffset = IPS::read<usize, 3>(record, offset, 3);
+				if (fileOffset == IPS::endOfFile) {
+					// Footer with the size of the patched file, only if it's the last 3 bytes of the patch like in IPS::getSize
+					if (reader.offset() + 3 == patchSize && readRecordField(3)) {
+						offset = 0;
+						outputSize = std::max<u64>(outputSize, IPS::read<usize, 3>(record, offset, 3));
+					}
+					break;
+				}
+
+				if (!readRecordField(2)) {
+					return readError();
+				}
+
+				offset = 0;
+				u64 size = IPS::read<u16, 2>(record, offset, 2);
+				if (size == 0) {
+					if (!readRecordField(3)) {
+						return readError();
+					}
+
+					offset = 0;
+					size = IPS::read<u16, 2>(record, offset, 2);
+				} else {
+					if (reader.offset() + size > patchSize) {
+						return Result::InvalidPatch;
+					}
+
+					reader.seek(reader.offset() + size);
+				}
+
+				outputSize = std::max<u64>(outputSize, fileOffset + size);
+			}
+
+			if (reader.failed()) {
+				return Result::IOError;
+			}
+
+			// Copy the file to be patched to the output, padding it with 0s if it's smaller than the output
+			std::vector<u8> buffer(std::max<usize>(options.chunkSize, 64));
+			for (u64 offset = 0; offset < outputSize;) {
+				const usize count = usize(std::min<u64>(buffer.size(), outputSize - offset));
+				const u64 inputLeft = offset < input.size() ? input.size() - offset : 0;
+				const usize fromInput = usize(std::min<u64>(count, inputLeft));
+
+				if (fromInput != 0 && !input.read(offset, buffer.data(), fromInput)) {
+					return Result::IOError;
+				}
+
+				std::memset(buffer.data() + fromInput, 0, count - fromInput);
+				if (!output.write(offset, buffer.data(), count)) {
+					return Result::IOError;
+				}
+
+				offset += count;
+			}
+
+			// Then apply the records on top of it
+			reader.seek(IPS::headerSize);
+			while (reader.offset() < patchSize) {
+				if (!readRecordField(3)) {
+					return readError();
+				}
+
+				usize offset = 0;
+				const usize fileOffset = IPS::read<usize, 3>(record, offset, 3);
+				if (fileOffset == IPS::endOfFile) {
+					break;
+				}
+
+				if (!readRecordField(2)) {
+					return readError();
+				}
+
+				offset = 0;
+				const u16 size = IPS::read<u16, 2>(record, offset, 2);
+
+				if (size == 0) {
+					// RLE encoding
+					if (!readRecordField(3)) {
+						return readError();
+					}
+
+					offset = 0;
+					const u16 rleSize = IPS::read<u16, 2>(record, offset, 3);
+					const u8 value = IPS::read<u8, 1>(record, offset, 3);
+
+					std::memset(buffer.data(), value, std::min<usize>(rleSize, buffer.size()));
+					for (usize written = 0; written < rleSize;) {
+						const usize count = std::min<usize>(rleSize - written, buffer.size());
+						if (!output.write(fileOffset + written, buffer.data(), count)) {
+							return Result::IOError;
+						}
+
+						written += count;
+					}
+				} else {
+					for (usize written = 0; written < size;) {
+						const usize count = std::min<usize>(reader.peek(size - written), size - written);
+						if (count == 0) {
+							return readError();
+						}
+
+						if (!output.write(fileOffset + written, reader.data(), count)) {
+							return Result::IOError;
+						}
+
+						reader.skip(count);
+						written += count;
+					}
+				}
+			}
+
+			return reader.failed() ? Result::IOError : Result::Success;
+		}
+
+		// Same as Hips::patchUPS, in a single pass over the input, the patch and the output after verifying the checksums
+		static Result patchUPS(Source& input, Source& patch, Sink& output, const Options& options = {}) {
+			const u64 patchSize = patch.size();
+			if (patchSize < UPS::minimumPatchSize) {
+				return Result::InvalidPatch;
+			}
+
+			Detail::StreamReader patchReader(patch, options.chunkSize);
+			if (patchReader.peek(UPS::headerSize) < UPS::headerSize || std::memcmp(patchReader.data(), "UPS1", UPS::headerSize) != 0) {
+				return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+			}
+
+			patchReader.skip(UPS::headerSize);
+			u64 inputSize, outputSize;
+			if (!patchReader.readRunLength(inputSize) || !patchReader.readRunLength(outputSize)) {
+				return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+			}
+
+			// The file we're trying to patch is smaller than the input is meant to be, reject it
+			if (input.size() < inputSize) {
+				return Result::SizeMismatch;
+			}
+
+			Detail::Checksums checksums;
+			if (const Result result = Detail::verifyStreamChecksums(input, inputSize, patch, checksums, options.chunkSize); result != Result::Success) {
+				return result;
+			}
+
+			Detail::StreamReader inputReader(input, options.chunkSize);
+			Detail::StreamWriter writer(output, options.windowSize, 0);
+
+			// Copies "length" bytes from the input as-is, padding with 0s past its end
+			const auto copyInput = [&](u64 length) {
+				while (length != 0) {
+					usize room;
+					u8* dest = writer.reserve(room);
+					const usize count = usize(std::min<u64>(room, length));
+
+					inputReader.read(dest, count);
+					writer.commit(count);
+					length -= count;
+				}
+			};
+
+			while (patchReader.offset() < patchSize - 12 && writer.offset() < outputSize) {
+				u64 length;
+				if (!patchReader.readRunLength(length)) {
+					return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+				}
+
+				copyInput(std::min<u64>(length, outputSize - writer.offset()));
+
+				// Patch with XOR until we find the terminating patch value (0x00), one buffer at a time
+				while (writer.offset() < outputSize) {
+					usize room;
+					u8* dest = writer.reserve(room);
+					usize count = usize(std::min<u64>({room, outputSize - writer.offset(), options.chunkSize}));
+
+					// xorRun treats the end of the data it's given as the end of the patch and the source, so only give it
+					// as much as is actually buffered. Past the end of the input it really does read as 0s
+					count = std::min<usize>(count, patchReader.peek(count));
+					if (count == 0) {
+						return patchReader.failed() ? Result::IOError : Result::InvalidPatch;  // The run goes past the end of the patch
+					}
+
+					const usize inputAvailable = std::min<usize>(inputReader.peek(count), count);
+					usize sourceOffset = 0;
+					usize patchOffset = 0;
+					const usize patched =
+						Detail::xorRun(dest, count, inputReader.data(), sourceOffset, inputAvailable, patchReader.data(), patchOffset, count);
+
+					const bool terminated = patchReader.data()[patched - 1] == 0;
+					writer.commit(patched);
+					patchReader.skip(patched);
+					inputReader.skip(std::min<usize>(patched, inputAvailable));
+
+					if (terminated) {
+						break;
+					}
+				}
+			}
+
+			// Copy the rest of the bytes, padding the output with 0s if the input is smaller than it
+			copyInput(outputSize - writer.offset());
+
+			if (!writer.finish() || patchReader.failed() || inputReader.failed()) {
+				return Result::IOError;
+			}
+
+			return writer.checksum() == checksums.output ? Result::Success : Result::ChecksumMismatch;
+		}
+
+		// Same as Hips::patchBPS, in a single pass over the patch and the output after verifying the checksums. The input is
+		// read wherever SourceRead/SourceCopy actions point to, and TargetCopy actions reaching further back than the output
+		// window read the output back from the sink
+		static Result patchBPS(Source& input, Source& patch, Sink& output, const Options& options = {}) {
+			const u64 patchSize = patch.size();
+			if (patchSize < BPS::minimumPatchSize) {
+				return Result::InvalidPatch;
+			}
+
+			Detail::StreamReader patchReader(patch, options.chunkSize);
+			if (patchReader.peek(BPS::headerSize) < BPS::headerSize || std::memcmp(patchReader.data(), "BPS1", BPS::headerSize) != 0) {
+				return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+			}
+
+			patchReader.skip(BPS::headerSize);
+			u64 inputSize, outputSize, metadataSize;
+			if (!patchReader.readRunLength(inputSize) || !patchReader.readRunLength(outputSize) || !patchReader.readRunLength(metadataSize)) {
+				return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+			}
+
+			// Skip over the metadata, which we don't have any use for
+			if (metadataSize > patchSize - patchReader.offset()) {
+				return Result::InvalidPatch;
+			}
+
+			patchReader.seek(patchReader.offset() + metadataSize);
+
+			// The file we're trying to patch is smaller than the input is meant to be, reject it
+			const u64 dataSize = input.size();
+			if (dataSize < inputSize) {
+				return Result::SizeMismatch;
+			}
+
+			Detail::Checksums checksums;
+			if (const Result result = Detail::verifyStreamChecksums(input, inputSize, patch, checksums, options.chunkSize); result != Result::Success) {
+				return result;
+			}
+
+			Detail::StreamReader inputReader(input, options.chunkSize);
+			// Keep half of the window around when it fills up, so that TargetCopies from recent output can be served from it
+			Detail::StreamWriter writer(output, options.windowSize, options.windowSize / 2);
+
+			// Appends "length" bytes from "offset" in the input, which the caller has bounds checked
+			const auto copyInput = [&](u64 offset, u64 length) {
+				inputReader.seek(offset);
+				while (length != 0) {
+					usize room;
+					u8* dest = writer.reserve(room);
+					const usize count = usize(std::min<u64>(room, length));
+
+					inputReader.read(dest, count);
+					writer.commit(count);
+					length -= count;
+				}
+			};
+
+			u64 sourceOffset = 0;
+			u64 outputOffset2 = 0;  // Offset used for TargetCopy commands
+
+			while (patchReader.offset() < patchSize - 12) {
+				u64 word;
+				if (!patchReader.readRunLength(word)) {
+					return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+				}
+
+				const u64 action = (word & 3);
+				const u64 length = (word >> 2) + 1;
+				const u64 outputOffset = writer.offset();
+
+				// An action writing past the end of the output means the patch is broken
+				if (length > outputSize - outputOffset) {
+					return Result::InvalidPatch;
+				}
+
+				switch (action) {
+					case BPS::Action::SourceRead: {
+						// Copy from the same offset in the input file
+						if (outputOffset > dataSize || length > dataSize - outputOffset) {
+							return Result::InvalidPatch;
+						}
+
+						copyInput(outputOffset, length);
+						break;
+					}
+
+					case BPS::Action::TargetRead: {
+						for (u64 left = length; left != 0;) {
+							usize room;
+							u8* dest = writer.reserve(room);
+							const usize count = usize(std::min<u64>(room, left));
+
+							if (patchReader.read(dest, count) != count) {
+								return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+							}
+
+							writer.commit(count);
+							left -= count;
+						}
+						break;
+					}
+
+					case BPS::Action::SourceCopy: {
+						u64 data;
+						if (!patchReader.readRunLength(data)) {
+							return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+						}
+
+						const u64 offset = data >> 1;
+						sourceOffset += (data & 1) ? -offset : +offset;
+
+						// Copying from outside the input file means the patch is broken
+						if (sourceOffset > dataSize || length > dataSize - sourceOffset) {
+							return Result::InvalidPatch;
+						}
+
+						copyInput(sourceOffset, length);
+						sourceOffset += length;
+						break;
+					}
+
+					case BPS::Action::TargetCopy: {
+						u64 data;
+						if (!patchReader.readRunLength(data)) {
+							return patchReader.failed() ? Result::IOError : Result::InvalidPatch;
+						}
+
+						const u64 offset = data >> 1;
+						outputOffset2 += (data & 1) ? -offset : +offset;
+
+						// We can only copy from the part of the output that's already been written
+						if (outputOffset2 >= outputOffset) {
+							return Result::InvalidPatch;
+						}
+
+						if (!writer.copyFromOutput(outputOffset2, length)) {
+							return Result::IOError;
+						}
+
+						outputOffset2 += length;
+						break;
+					}
+				}
+			}
+
+			// Pad rest of the output with 0s
+			writer.fill(0, outputSize - writer.offset());
+
+			if (!writer.finish() || patchReader.failed() || inputReader.failed()) {
+				return Result::IOError;
+			}
+
+			return writer.checksum() == checksums.output ? Result::Success : Result::ChecksumMismatch;
+		}
+
+		static inline Result patch(Source& input, Source& patch, Sink& output, PatchType type, const Options& options = {}) {
+			switch (type) {
+				case PatchType::IPS: return patchIPS(input, patch, output, options);
+				case PatchType::UPS: return patchUPS(input, patch, output, options);
+				case PatchType::BPS: return patchBPS(input, patch, output, options);
+				default: return Result::UnknownFormat;  // Unknown patch format
+			}
+		}
+	}  // namespace Stream
+
+	// Patching by range writes: instead of producing the whole patched file, only the parts of it that a patch changes are
+	// written, on top of a copy of the input (eg a reflink of the input file) or on top of the input itself. The I/O this
+	// takes scales with the size of the patch rather than the size of the file, which is what matters for patches that
+	// change a few bytes of a multi-GB image
+
+	// A stretch of the output that a patch changes
+	struct Range {
+		u64 offset;
+		u64 length;
+	};
+
+	namespace Detail {
+		// Appends a range, merging it into the last one if they overlap or touch
+		static void addRange(std::vector<Range>& ranges, u64 offset, u64 length) {
+			if (length == 0) {
+				return;
+			}
+
+			if (!ranges.empty()) {
+				Range& last = ranges.back();
+				if (offset >= last.offset && offset <= last.offset + last.length) {
+					last.length = std::max(last.length, offset + length - last.offset);
+					return;
+				}
+			}
+
+			ranges.push_back({offset, length});
+		}
+
+		// Sorts ranges and merges the ones that overlap or touch, since IPS records can come in any order
+		static void mergeRanges(std::vector<Range>& ranges) {
+			std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.offset < b.offset; });
+
+			std::vector<Range> merged;
+			merged.reserve(ranges.size());
+			for (const Range& range : ranges) {
+				addRange(merged, range.offset, range.length);
+			}
+
+			ranges = std::move(merged);
+		}
+
+		// Whether [offset, offset + length) overlaps any of a list of sorted, disjoint ranges
+		static bool overlapsRanges(const std::vector<Range>& ranges, u64 offset, u64 length) {
+			// First range that ends after "offset"
+			const auto range = std::partition_point(ranges.begin(), ranges.end(), [&](const Range& r) { return r.offset + r.length <= offset; });
+			return range != ranges.end() && range->offset < offset + length;
+		}
+
+		// Walks the records of an IPS patch that passed checkPatch, calling visit(outputOffset, length, patchOffset, rle) for
+		// each with the record clamped to the output, where "patchOffset" is where its data (or RLE value) is in the patch
+		template <typename Policy, typename Visitor>
+		static Result walkIPS(const u8* patch, usize patchSize, usize outputSize, Visitor&& visit) {
+			usize offset = IPS::headerSize;
+			while (offset < patchSize) {
+				const usize fileOffset = IPS::read<usize, 3, Policy>(patch, offset, patchSize);
+				if (fileOffset == IPS::endOfFile) {
+					break;
+				}
+
+				const u16 size = IPS::read<u16, 2, Policy>(patch, offset, patchSize);
+				const usize recordOffset = std::min<usize>(fileOffset, outputSize);
+				const usize room = outputSize - recordOffset;
+				Result result;
+
+				if (size == 0) {
+					const u16 rleSize = IPS::read<u16, 2, Policy>(patch, offset, patchSize);
+					offset += 1;
+					result = (Policy::checkReads && offset > patchSize) ? Result::InvalidPatch
+																		 : visit(recordOffset, std::min<usize>(rleSize, room), offset - 1, true);
+				} else {
+					const usize dataOffset = offset;
+					offset += size;
+					result = (Policy::checkReads && offset > patchSize) ? Result::InvalidPatch
+																		 : visit(recordOffset, std::min<usize>(size, room), dataOffset, false);
+				}
+
+				if (result != Result::Success) {
+					return result;
+				}
+			}
+
+			return Result::Success;
+		}
+
+		// Walks the hunks of a UPS patch, calling visit(outputOffset, length, patchOffset) for each XOR run with the bytes
+		// it changes. Those are the bytes before its terminator, which is XORed with a byte that stays the same. The input
+		// and output offsets are always the same in UPS patches, so "outputOffset" is where the run reads the input too
+		template <typename Policy, typename Visitor>
+		static Result walkUPS(const u8* patch, usize patchSize, const UPS::Header& header, Visitor&& visit) {
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.hunksOffset;
+			usize outputOffset = 0;
+
+			while (patchOffset < patchSize - 12 && outputOffset < outputSize) {
+				const u64 length = UPS::readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+				outputOffset += std::min<usize>(length, outputSize - outputOffset);
+
+				// Same as Detail::xorRun, the run stops at the output's end, or at a terminator, which the end of the patch
+				// counts as
+				const usize room = outputSize - outputOffset;
+				const usize available = patchOffset < patchSize ? std::min<usize>(room, patchSize - patchOffset) : 0;
+				const u8* run = patch + std::min(patchOffset, patchSize);
+				const u8* terminator = (const u8*)std::memchr(run, 0, available);
+				const usize changed = terminator != nullptr ? usize(terminator - run) : available;
+
+				if (const Result result = visit(outputOffset, changed, patchOffset); result != Result::Success) {
+					return result;
+				}
+
+				const usize consumed = std::min<usize>(changed + 1, room);
+				outputOffset += consumed;
+				patchOffset += consumed;
+
+				if (Policy::checkReads && patchOffset > patchSize) {
+					return Result::InvalidPatch;
+				}
+			}
+
+			return Result::Success;
+		}
+
+		// Walks the actions of a BPS patch, calling visit(action, outputOffset, length, from) for each, where "from" is where
+		// the action copies from: the input for SourceRead and SourceCopy, the patch for TargetRead and the output for
+		// TargetCopy. Checks everything BPS::apply does that doesn't need the input, and sets "outputEnd" to where the
+		// actions stop, as the rest of the output is padded with 0s
+		template <typename Policy, typename Visitor>
+		static Result walkBPS(const u8* patch, usize patchSize, const BPS::Header& header, usize& outputEnd, Visitor&& visit) {
+			const u64 outputSize = header.outputSize;
+			usize patchOffset = header.actionsOffset;
+			usize sourceOffset = 0;
+			usize targetOffset = 0;
+			usize outputOffset = 0;
+
+			while (patchOffset < patchSize - 12) {
+				const u64 word = BPS::readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+				const u32 action = u32(word & 3);
+				const u64 length = (word >> 2) + 1;
+
+				if (length > outputSize - outputOffset) {
+					return Result::InvalidPatch;
+				}
+
+				usize from = outputOffset;
+				if (action == BPS::Action::TargetRead) {
+					from = patchOffset;
+					patchOffset += length;
+				} else if (action == BPS::Action::SourceCopy || action == BPS::Action::TargetCopy) {
+					usize& relativeOffset = action == BPS::Action::SourceCopy ? sourceOffset : targetOffset;
+					const u64 data = BPS::readRunLength<u64, Policy>(patch, patchOffset, patchSize);
+					const s64 offset = s64(data >> 1);
+					relativeOffset += (data & 1) ? -offset : +offset;
+					from = relativeOffset;
+					relativeOffset += length;
+
+					// We can only copy from the part of the output that's already been written
+					if (action == BPS::Action::TargetCopy && from >= outputOffset) {
+						return Result::InvalidPatch;
+					}
+				}
+
+				if (Policy::checkReads && patchOffset > patchSize) {
+					return Result::InvalidPatch;
+				}
+
+				if (const Result result = visit(action, outputOffset, usize(length), from); result != Result::Success) {
+					return result;
+				}
+
+				outputOffset += length;
+			}
+
+			outputEnd = outputOffset;
+			return Result::Success;
+		}
+
+		static bool patchChecksumMatches(const u8* patch, usize patchSize) {
+			return crc32(patch, patchSize - 4) == readChecksums(patch, patchSize).patch;
+		}
+	}  // namespace Detail
+
+	// Returns the ranges of the output that a patch changes, sorted and merged. Anything outside of them is the same as in the
+	// input, or 0 past the end of the input
+	template <typename Policy = ReadPolicy::Checked>
+	static std::pair<std::vector<Range>, Result> modifiedRanges(const u8* patch, usize patchSize, PatchType type) {
+		std::vector<Range> ranges;
+		Result result;
+
+		switch (type) {
+			case PatchType::IPS: {
+				if (result = IPS::checkPatch<Policy>(patch, patchSize); result != Result::Success) {
+					break;
+				}
+
+				result = Detail::walkIPS<Policy>(patch, patchSize, IPS::getSize<Policy>(patch, patchSize), [&](usize offset, usize length, usize, bool) {
+					ranges.push_back({offset, length});
+					return Result::Success;
+				});
+				Detail::mergeRanges(ranges);
+				break;
+			}
+
+			case PatchType::UPS: {
+				UPS::Header header;
+				if (result = UPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+					break;
+				}
+
+				result = Detail::walkUPS<Policy>(patch, patchSize, header, [&](usize offset, usize length, usize) {
+					Detail::addRange(ranges, offset, length);
+					return Result::Success;
+				});
+				break;
+			}
+
+			case PatchType::BPS: {
+				BPS::Header header;
+				if (result = BPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+					break;
+				}
+
+				// SourceReads, and SourceCopies from the same offset, leave the input as it is
+				usize outputEnd = 0;
+				result = Detail::walkBPS<Policy>(patch, patchSize, header, outputEnd, [&](u32 action, usize offset, usize length, usize from) {
+					if (action != BPS::Action::SourceRead && !(action == BPS::Action::SourceCopy && from == offset)) {
+						Detail::addRange(ranges, offset, length);
+					}
+
+					return Result::Success;
+				});
+
+				// The 0s the output gets padded with
+				Detail::addRange(ranges, outputEnd, header.outputSize - outputEnd);
+				break;
+			}
+
+			default: return {{}, Result::UnknownFormat};
+		}
+
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		return {std::move(ranges), Result::Success};
+	}
+
+	// Whether patchRanges can apply a patch straight on top of its input. IPS and UPS patches always can, as they only read
+	// the input at the offset they're writing to, while BPS patches can't if they copy from parts of the input they already
+	// overwrote. Invalid patches return false
+	template <typename Policy = ReadPolicy::Checked>
+	static bool canPatchInPlace(const u8* patch, usize patchSize, PatchType type) {
+		if (type != PatchType::BPS) {
+			return modifiedRanges<Policy>(patch, patchSize, type).second == Result::Success;
+		}
+
+		BPS::Header header;
+		if (BPS::readHeader<Policy>(patch, patchSize, header) != Result::Success) {
+			return false;
+		}
+
+		std::vector<Range> written;
+		usize outputEnd;
+		const Result result = Detail::walkBPS<Policy>(patch, patchSize, header, outputEnd, [&](u32 action, usize offset, usize length, usize from) {
+			if (action == BPS::Action::SourceRead || (action == BPS::Action::SourceCopy && from == offset)) {
+				return Result::Success;
+			}
+
+			// Copies are written in chunks, so a copy overlapping its own destination would read bytes it already wrote
+			const bool overlapsItself = from < offset + length && offset < from + length;
+			if (action == BPS::Action::SourceCopy && (overlapsItself || Detail::overlapsRanges(written, from, length))) {
+				return Result::InvalidPatch;  // Just stops the walk
+			}
+
+			Detail::addRange(written, offset, length);
+			return Result::Success;
+		});
+
+		return result == Result::Success;
+	}
+
+	// Applies a patch by writing only the ranges of the output that modifiedRanges returns into "output", which has to
+	// already hold the input, resized to the size of the output (queryOutputSize) with 0s past the end of the input. The
+	// sink can be the input itself if canPatchInPlace allows it, in which case "data" is read after being written to.
+	// BPS patches read earlier output back from the sink for TargetCopy actions.
+	//
+	// Checking the input and output checksums would mean reading all of both, so for UPS and BPS patches only the patch's
+	// own checksum is checked. Callers can still checksum the files with crc32 against the values in the patch if needed
+	template <typename Policy = ReadPolicy::Checked>
+	static Result patchRanges(const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type, Stream::Sink& output) {
+		// Ranges are written from this buffer in chunks when they aren't already in memory, like RLE records and XOR runs
+		static constexpr usize chunkSize = 64 * 1024;
+		std::vector<u8> buffer;
+		const auto writeFill = [&](usize offset, u8 value, usize length) {
+			buffer.assign(std::min(chunkSize, length), value);
+			for (usize written = 0; written < length; written += buffer.size()) {
+				if (!output.write(offset + written, buffer.data(), std::min(buffer.size(), length - written))) {
+					return Result::IOError;
+				}
+			}
+
+			return Result::Success;
+		};
+
+		switch (type) {
+			case PatchType::IPS: {
+				if (const Result result = IPS::checkPatch<Policy>(patch, patchSize); result != Result::Success) {
+					return result;
+				}
+
+				const usize outputSize = IPS::getSize<Policy>(patch, patchSize);
+				return Detail::walkIPS<Policy>(patch, patchSize, outputSize, [&](usize offset, usize length, usize patchOffset, bool rle) {
+					if (rle) {
+						return writeFill(offset, patch[patchOffset], length);
+					}
+
+					return output.write(offset, patch + patchOffset, length) ? Result::Success : Result::IOError;
+				});
+			}
+
+			case PatchType::UPS: {
+				UPS::Header header;
+				if (const Result result = UPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+					return result;
+				}
+
+				if (dataSize < header.inputSize) {
+					return Result::SizeMismatch;
+				}
+
+				if (!Detail::patchChecksumMatches(patch, patchSize)) {
+					return Result::ChecksumMismatch;
+				}
+
+				buffer.resize(chunkSize);
+				return Detail::walkUPS<Policy>(patch, patchSize, header, [&](usize offset, usize length, usize patchOffset) {
+					// Runs don't have a terminator in them, so xorRun goes for as long as it's allowed to
+					for (usize done = 0; done < length;) {
+						const usize chunk = std::min(chunkSize, length - done);
+						usize sourceOffset = offset + done;
+						usize runOffset = patchOffset + done;
+						Detail::xorRun(buffer.data(), chunk, data, sourceOffset, dataSize, patch, runOffset, patchSize);
+
+						if (!output.write(offset + done, buffer.data(), chunk)) {
+							return Result::IOError;
+						}
+
+						done += chunk;
+					}
+
+					return Result::Success;
+				});
+			}
+
+			case PatchType::BPS: {
+				BPS::Header header;
+				if (const Result result = BPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+					return result;
+				}
+
+				if (dataSize < header.inputSize) {
+					return Result::SizeMismatch;
+				}
+
+				if (!Detail::patchChecksumMatches(patch, patchSize)) {
+					return Result::ChecksumMismatch;
+				}
+
+				usize outputEnd = 0;
+				const Result result = Detail::walkBPS<Policy>(patch, patchSize, header, outputEnd, [&](u32 action, usize offset, usize length, usize from) {
+					switch (action) {
+						case BPS::Action::SourceRead:
+							return (offset > dataSize || length > dataSize - offset) ? Result::InvalidPatch : Result::Success;
+
+						case BPS::Action::TargetRead:
+							return output.write(offset, patch + from, length) ? Result::Success : Result::IOError;
+
+						case BPS::Action::SourceCopy:
+							if (from > dataSize || length > dataSize - from) {
+								return Result::InvalidPatch;
+							}
+
+							return (from == offset || output.write(offset, data + from, length)) ? Result::Success : Result::IOError;
+
+						default: {
+							// TargetCopy. Copies that overlap their destination repeat the "distance" bytes before it, so those are
+							// read once and repeated. Otherwise, chunks are never larger than the distance, so every chunk
+							// is read from output that's been written already
+							const usize distance = offset - from;
+							if (distance < length && distance <= chunkSize / 2) {
+								buffer.resize(distance);
+								if (!output.read(from, buffer.data(), distance)) {
+									return Result::IOError;
+								}
+
+								const usize period = (chunkSize / distance) * distance;
+								buffer.resize(period);
+								Detail::copyForward(buffer.data() + distance, buffer.data(), period - distance);
+
+								for (usize done = 0; done < length; done += period) {
+									if (!output.write(offset + done, buffer.data(), std::min(period, length - done))) {
+										return Result::IOError;
+									}
+								}
+
+								return Result::Success;
+							}
+
+							buffer.resize(std::min({chunkSize, length, distance}));
+							for (usize done = 0; done < length; done += buffer.size()) {
+								const usize chunk = std::min(buffer.size(), length - done);
+								if (!output.read(from + done, buffer.data(), chunk) || !output.write(offset + done, buffer.data(), chunk)) {
+									return Result::IOError;
+								}
+							}
+
+							return Result::Success;
+						}
+					}
+				});
+
+				if (result != Result::Success) {
+					return result;
+				}
+
+				// The output is padded with 0s after the last action, which only needs writing where the input was
+				const usize paddingEnd = std::min<usize>(header.outputSize, dataSize);
+				return outputEnd < paddingEnd ? writeFill(outputEnd, 0, paddingEnd - outputEnd) : Result::Success;
+			}
+
+			default: return Result::UnknownFormat;
+		}
+	}
+
+	// Checking patches without applying them, eg before storing patches uploaded by users. This walks the records, hunks or
+	// actions of a patch the same way the patchers do, but without allocating or writing any output, so it's about as fast
+	// as decoding the patch. It's stricter than the patchers, which put up with some malformed patches
+
+	// Checks that a patch is well-formed without applying it or allocating anything, and returns the sizes and checksums in its
+	// header, or what's wrong with it and where. With "inputSize", the input is also checked to be as large as the patch needs
+	static inline ValidationReport validate(const u8* patch, usize patchSize, PatchType type, u64 inputSize = ~u64(0)) {
+		switch (type) {
+			case PatchType::IPS: return IPS::validate<true>(patch, patchSize);
+			case PatchType::UPS: return UPS::validate<true>(patch, patchSize, inputSize);
+			case PatchType::BPS: return BPS::validate<true>(patch, patchSize, inputSize);
+
+			default: {
+				ValidationReport report;
+				report.result = Result::UnknownFormat;
+				report.error = PatchError::BadHeader;
+				return report;
+			}
+		}
+	}
+
+	// Caching patched files, for services that see the same inputs and patches over and over. Outputs are keyed by the
+	// CRC32s and sizes of the input and the patch, so finding one costs a CRC32 of the input (which applying a UPS or BPS
+	// patch takes anyway) instead of applying the patch again
+
+	// Identifies the output of applying a patch to an input
+	struct CacheKey {
+		u32 inputCRC = 0;
+		u32 patchCRC = 0;
+		u64 inputSize = 0;
+		u64 patchSize = 0;
+		PatchType type = PatchType::IPS;
+
+		bool operator==(const CacheKey&) const = default;
+	};
+
+	// An output from a cache. "owner" keeps its bytes alive for as long as it's held, even if the cache drops them meanwhile
+	struct CachedOutput {
+		std::span<const u8> data;
+		std::shared_ptr<const void> owner;
+	};
+
+	struct CacheStats {
+		u64 hits = 0;
+		u64 misses = 0;
+		u64 stores = 0;
+		u64 evictions = 0;
+	};
+
+	// Somewhere to keep patched files, for patchCached. MemoryCache below keeps them in memory, and DirectoryCache in
+	// examples/utils keeps them in files. Other caches implement lookup and insert, which can be called from several threads
+	// at once
+	class Cache {
+	  public:
+		virtual ~Cache() = default;
+
+		bool find(const CacheKey& key, CachedOutput& output) {
+			const bool found = lookup(key, output);
+			(found ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+			return found;
+		}
+
+		void store(const CacheKey& key, const CachedOutput& output) {
+			stores.fetch_add(1, std::memory_order_relaxed);
+			insert(key, output);
+		}
+
+		CacheStats stats() const {
+			const auto load = [](const std::atomic<u64>& counter) { return counter.load(std::memory_order_relaxed); };
+			return {load(hits), load(misses), load(stores), load(evictions)};
+		}
+
+	  protected:
+		virtual bool lookup(const CacheKey& key, CachedOutput& output) = 0;
+		virtual void insert(const CacheKey& key, const CachedOutput& output) = 0;
+
+		void countEviction() { evictions.fetch_add(1, std::memory_order_relaxed); }
+
+	  private:
+		std::atomic<u64> hits = 0;
+		std::atomic<u64> misses = 0;
+		std::atomic<u64> stores = 0;
+		std::atomic<u64> evictions = 0;
+	};
+
+	namespace Detail {
+		struct CacheKeyHash {
+			usize operator()(const CacheKey& key) const {
+				u64 hash = (u64(key.inputCRC) << 32) | key.patchCRC;
+				hash ^= (key.inputSize + 0x9E3779B97F4A7C15ull) * 0xC2B2AE3D27D4EB4Full;
+				hash ^= (key.patchSize * 4 + u64(key.type)) * 0x165667B19E3779F9ull;
+				return usize(hash ^ (hash >> 32));
+			}
+		};
+	}  // namespace Detail
+
+	// Keeps the most recently used outputs in memory, up to "byteBudget" bytes of them. Outputs larger than the budget
+	// aren't kept at all. Stored outputs are shared with whoever stored them rather than copied
+	class MemoryCache final : public Cache {
+	  public:
+		explicit MemoryCache(usize byteBudget) : byteBudget(byteBudget) {}
+
+		usize usedBytes() const {
+			std::scoped_lock lock(mutex);
+			return bytes;
+		}
+
+		usize entryCount() const {
+			std::scoped_lock lock(mutex);
+			return entries.size();
+		}
+
+	  protected:
+		bool lookup(const CacheKey& key, CachedOutput& output) override {
+			std::scoped_lock lock(mutex);
+			const auto entry = index.find(key);
+			if (entry == index.end()) {
+				return false;
+			}
+
+			// Most recently used outputs are kept at the front of the list, so the one at the back is the next to go
+			entries.splice(entries.begin(), entries, entry->second);
+			output = entry->second->second;
+			return true;
+		}
+
+		void insert(const CacheKey& key, const CachedOutput& output) override {
+			if (output.data.size() > byteBudget) {
+				return;
+			}
+
+			std::scoped_lock lock(mutex);
+			if (const auto existing = index.find(key); existing != index.end()) {
+				bytes -= existing->second->second.data.size();
+				entries.erase(existing->second);
+				index.erase(existing);
+			}
+
+			entries.emplace_front(key, output);
+			index.emplace(key, entries.begin());
+			bytes += output.data.size();
+
+			while (bytes > byteBudget) {
+				bytes -= entries.back().second.data.size();
+				index.erase(entries.back().first);
+				entries.pop_back();
+				countEviction();
+			}
+		}
+
+	  private:
+		using Entry = std::pair<CacheKey, CachedOutput>;
+
+		mutable std::mutex mutex;
+		std::list<Entry> entries;
+		std::unordered_map<CacheKey, std::list<Entry>::iterator, Detail::CacheKeyHash> index;
+		usize byteBudget;
+		usize bytes = 0;
+	};
+
+	// Works out the key of the output of applying a patch to "data". The CRC32 of UPS and BPS patches is checked against the
+	// one at their end, so a damaged patch can't be mistaken for the one it used to be. IPS patches don't have any, so theirs
+	// gets computed, which is quick next to the input's
+	static std::pair<CacheKey, Result> cacheKey(const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type) {
+		CacheKey key;
+		key.inputSize = dataSize;
+		key.patchSize = patchSize;
+		key.type = type;
+
+		if (type != PatchType::IPS && type != PatchType::UPS && type != PatchType::BPS) {
+			return {key, Result::UnknownFormat};
+		} else if (patch == nullptr || (type != PatchType::IPS && patchSize < 12)) {
+			return {key, Result::InvalidPatch};
+		}
+
+		if (type == PatchType::IPS) {
+			key.patchCRC = Detail::crc32(patch, patchSize);
+		} else {
+			key.patchCRC = Detail::readChecksums(patch, patchSize).patch;
+			if (Detail::crc32(patch, patchSize - 4) != key.patchCRC) {
+				return {key, Result::ChecksumMismatch};
+			}
+		}
+
+		key.inputCRC = Detail::crc32(data, dataSize);
+		return {key, Result::Success};
+	}
+
+	// Same as patch, but the output is taken from "cache" if it's been made before, and put there otherwise. Only patches
+	// that applied successfully get cached
+	template <typename Policy = ReadPolicy::Checked>
+	static std::pair<CachedOutput, Result> patchCached(
+		Cache& cache, const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type,
+		Verification verification = Verification::Eager
+	) {
+		const auto [key, keyResult] = cacheKey(data, dataSize, patch, patchSize, type);
+		if (keyResult != Result::Success) {
+			return {{}, keyResult};
+		}
+
+		CachedOutput output;
+		if (cache.find(key, output)) {
+			return {std::move(output), Result::Success};
+		}
+
+		auto [bytes, result] = Hips::patch<Policy>(data, dataSize, patch, patchSize, type, verification);
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		const auto owner = std::make_shared<const std::vector<u8>>(std::move(bytes));
+		output = {std::span<const u8>(owner->data(), owner->size()), owner};
+		cache.store(key, output);
+		return {std::move(output), Result::Success};
+	}
+
+	// Undo patches: while a patch gets applied, the parts of the input it overwrites are recorded into a patch that turns
+	// the output back into the input. Only those parts of the input get read for it, and they were just read to patch
+	// anyway, so undoing a small patch to a large file costs about as much as the patch, instead of a copy of the input
+
+	// A patch that undoes another. Its format isn't always the same as the original's
+	struct UndoPatch {
+		std::vector<u8> data;
+		PatchType type = PatchType::IPS;
+	};
+
+	namespace Detail {
+		// Where a piece of the input ended up in the output
+		struct InputMapping {
+			u64 inputOffset;
+			u64 outputOffset;
+			u64 length;
+		};
+
+		// Creates a BPS patch that turns an output back into its input of "inputSize" bytes. The parts of the input in
+		// "mappings" get copied from wherever the output has them, and the rest is stored in the patch
+		static std::vector<u8> undoFromMappings(
+			const u8* data, usize inputSize, usize outputSize, std::vector<InputMapping>& mappings, u32 inputCRC, u32 outputCRC
+		) {
+			std::sort(mappings.begin(), mappings.end(), [](const InputMapping& a, const InputMapping& b) { return a.inputOffset < b.inputOffset; });
+
+			std::vector<u8> out = {'B', 'P', 'S', '1'};
+			writeRunLength(out, outputSize);
+			writeRunLength(out, inputSize);
+			writeRunLength(out, 0);  // No metadata
+
+			u64 sourceRelativeOffset = 0;
+			u64 literalStart = 0;
+			const auto writeAction = [&](u32 action, u64 length) { writeRunLength(out, ((length - 1) << 2) | action); };
+			const auto writeLiterals = [&](u64 end) {
+				if (end > literalStart) {
+					writeAction(BPS::Action::TargetRead, end - literalStart);
+					out.insert(out.end(), data + literalStart, data + end);
+				}
+
+				literalStart = end;
+			};
+
+			// Goes through the input front to back, always copying from the mapping that covers the current offset and goes
+			// on the furthest past it
+			u64 position = 0;
+			usize next = 0;
+			InputMapping furthest = {0, 0, 0};
+
+			while (position < inputSize) {
+				for (; next < mappings.size() && mappings[next].inputOffset <= position; next++) {
+					const InputMapping& mapping = mappings[next];
+					if (mapping.inputOffset + mapping.length > furthest.inputOffset + furthest.length) {
+						furthest = mapping;
+					}
+				}
+
+				const u64 end = std::min<u64>(furthest.inputOffset + furthest.length, inputSize);
+				if (end <= position) {
+					position = next < mappings.size() ? std::min<u64>(mappings[next].inputOffset, inputSize) : inputSize;
+					continue;
+				}
+
+				const u64 from = furthest.outputOffset + (position - furthest.inputOffset);
+				writeLiterals(position);
+				writeAction(from == position ? BPS::Action::SourceRead : BPS::Action::SourceCopy, end - position);
+
+				if (from != position) {
+					const bool negative = from < sourceRelativeOffset;
+					const u64 distance = negative ? sourceRelativeOffset - from : from - sourceRelativeOffset;
+					writeRunLength(out, (distance << 1) | (negative ? 1 : 0));
+					sourceRelativeOffset = from + (end - position);
+				}
+
+				position = end;
+				literalStart = end;
+			}
+
+			writeLiterals(inputSize);
+			writeLE32(out, outputCRC);
+			writeLE32(out, inputCRC);
+			writeLE32(out, crc32(out.data(), out.size()));
+			return out;
+		}
+
+		// Creates the undo patch of an IPS patch, which stores the input under every record along with whatever the output
+		// cut off the end of it. That's an IPS patch too, unless the input is too large for IPS offsets to reach the parts
+		// of it that need restoring, in which case it's a BPS patch that needs both files checksummed
+		template <typename Policy>
+		static Result undoIPS(
+			const u8* data, usize dataSize, const u8* output, usize outputSize, const u8* patch, usize patchSize, UndoPatch& undo
+		) {
+			std::vector<Range> ranges;
+			const Result result = walkIPS<Policy>(patch, patchSize, outputSize, [&](usize offset, usize length, usize, bool) {
+				if (offset < dataSize) {
+					ranges.push_back({offset, std::min<u64>(length, dataSize - offset)});
+				}
+
+				return Result::Success;
+			});
+
+			if (result != Result::Success) {
+				return result;
+			}
+
+			if (outputSize < dataSize) {
+				ranges.push_back({outputSize, dataSize - outputSize});
+			}
+
+			mergeRanges(ranges);
+
+			// Changes a few bytes apart go in the same record, same as in createIPS
+			IPS::Encoder encoder(data);
+			bool encoded = true;
+			for (usize i = 0; i < ranges.size() && encoded;) {
+				const usize begin = usize(ranges[i].offset);
+				usize end = usize(ranges[i].offset + ranges[i].length);
+
+				for (i++; i < ranges.size() && ranges[i].offset - end <= IPS::mergeDistance; i++) {
+					end = usize(ranges[i].offset + ranges[i].length);
+				}
+
+				encoded = encoder.writeRegion(begin, end);
+			}
+
+			if (encoded && encoder.finish(dataSize, outputSize)) {
+				undo = {std::move(encoder.out), PatchType::IPS};
+				return Result::Success;
+			}
+
+			// Everything outside of the records is the same in both files
+			std::vector<InputMapping> mappings;
+			u64 unchanged = 0;
+			for (const Range& range : ranges) {
+				if (range.offset > unchanged) {
+					mappings.push_back({unchanged, unchanged, range.offset - unchanged});
+				}
+
+				unchanged = range.offset + range.length;
+			}
+
+			if (std::min(dataSize, outputSize) > unchanged) {
+				mappings.push_back({unchanged, unchanged, std::min(dataSize, outputSize) - unchanged});
+			}
+
+			undo = {undoFromMappings(data, dataSize, outputSize, mappings, crc32(data, dataSize), crc32(output, outputSize)), PatchType::BPS};
+			return Result::Success;
+		}
+
+		// Creates the undo patch of a UPS patch. XOR runs work both ways, so it's the same runs with the input and output
+		// swapped, plus the end of the input if the output cut it off, as the runs stop at the end of the output
+		template <typename Policy>
+		static Result undoUPS(const u8* data, const u8* patch, usize patchSize, UndoPatch& undo) {
+			UPS::Header header;
+			if (const Result result = UPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+				return result;
+			}
+
+			std::vector<u8> out = {'U', 'P', 'S', '1'};
+			writeRunLength(out, header.outputSize);
+			writeRunLength(out, header.inputSize);
+
+			// A run that starts right where the last one ended carries on from it, instead of getting a terminator first
+			usize position = 0;
+			bool inRun = false;
+			const auto writeRun = [&](usize offset, const u8* xors, usize length) {
+				if (length == 0) {
+					return;
+				}
+
+				if (!inRun || offset != position) {
+					if (inRun) {
+						out.push_back(0);
+						position++;
+					}
+
+					writeRunLength(out, offset - position);
+				}
+
+				out.insert(out.end(), xors, xors + length);
+				position = offset + length;
+				inRun = true;
+			};
+
+			const Result result = walkUPS<Policy>(patch, patchSize, header, [&](usize offset, usize length, usize patchOffset) {
+				// Anything past the end of the input doesn't matter once it's the output
+				if (offset < header.inputSize) {
+					writeRun(offset, patch + patchOffset, std::min<usize>(length, usize(header.inputSize) - offset));
+				}
+
+				return Result::Success;
+			});
+
+			if (result != Result::Success) {
+				return result;
+			}
+
+			// Past the end of the output it reads as 0s, so the XOR of the input with it is the input itself. Its 0 bytes
+			// are the ones that don't change
+			for (usize offset = usize(header.outputSize); offset < header.inputSize;) {
+				const usize inputSize = usize(header.inputSize);
+				const u8* zero = (const u8*)std::memchr(data + offset, 0, inputSize - offset);
+				const usize end = zero != nullptr ? usize(zero - data) : inputSize;
+
+				writeRun(offset, data + offset, end - offset);
+				offset = end;
+				while (offset < inputSize && data[offset] == 0) {
+					offset++;
+				}
+			}
+
+			if (inRun) {
+				out.push_back(0);
+			}
+
+			const Checksums checksums = readChecksums(patch, patchSize);
+			writeLE32(out, checksums.output);
+			writeLE32(out, checksums.input);
+			writeLE32(out, crc32(out.data(), out.size()));
+			undo = {std::move(out), PatchType::UPS};
+			return Result::Success;
+		}
+
+		// Creates the undo patch of a BPS patch. Every SourceRead and SourceCopy says where a piece of the input ended up in
+		// the output, so the undo patch copies those back, and only stores the parts of the input that the output lost.
+		// Both checksums are in the patch already
+		template <typename Policy>
+		static Result undoBPS(const u8* data, const u8* patch, usize patchSize, UndoPatch& undo) {
+			BPS::Header header;
+			if (const Result result = BPS::readHeader<Policy>(patch, patchSize, header); result != Result::Success) {
+				return result;
+			}
+
+			const usize inputSize = usize(header.inputSize);
+			std::vector<InputMapping> mappings;
+			usize outputEnd;
+			const Result result = walkBPS<Policy>(patch, patchSize, header, outputEnd, [&](u32 action, usize offset, usize length, usize from) {
+				if ((action == BPS::Action::SourceRead || action == BPS::Action::SourceCopy) && from < inputSize) {
+					mappings.push_back({from, offset, std::min(length, inputSize - from)});
+				}
+
+				return Result::Success;
+			});
+
+			if (result != Result::Success) {
+				return result;
+			}
+
+			const Checksums checksums = readChecksums(patch, patchSize);
+			undo = {undoFromMappings(data, inputSize, usize(header.outputSize), mappings, checksums.input, checksums.output), PatchType::BPS};
+			return Result::Success;
+		}
+	}  // namespace Detail
+
+	// Same as patch, but also sets "undo" to a patch that turns the output back into the input, if patching succeeds. The
+	// undo patch of an IPS patch is IPS too (or BPS for inputs larger than IPS can address), BPS patches get a BPS one, and
+	// UPS patches, which already work both ways, get themselves with the input and output swapped. UPS and BPS undo
+	// patches turn the output back into as much of the input as the patch's header says it has
+	template <typename Policy = ReadPolicy::Checked, typename Allocator = std::allocator<u8>>
+	static std::pair<std::vector<u8, Allocator>, Result> patchWithUndo(
+		const u8* data, usize dataSize, const u8* patch, usize patchSize, PatchType type, UndoPatch& undo,
+		Verification verification = Verification::Eager
+	) {
+		auto [output, result] = Hips::patch<Policy, Allocator>(data, dataSize, patch, patchSize, type, verification);
+		if (result != Result::Success) {
+			return {std::move(output), result};
+		}
+
+		switch (type) {
+			case PatchType::IPS: result = Detail::undoIPS<Policy>(data, dataSize, output.data(), output.size(), patch, patchSize, undo); break;
+			case PatchType::UPS: result = Detail::undoUPS<Policy>(data, patch, patchSize, undo); break;
+			default: result = Detail::undoBPS<Policy>(data, patch, patchSize, undo); break;
+		}
+
+		if (result != Result::Success) {
+			return {{}, result};
+		}
+
+		return {std::move(output), Result::Success};
 	}
 }  // namespace Hips
\ No newline at end of file
@@ -0,0 +1,87 @@
+// Checks every CRC32 kernel built for this CPU, the one crc32 picks, the thread pool version and crc32Combine against a
+// bit at a time CRC32
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+using Bytes = std::vector<std::uint8_t>;
+
+static std::uint32_t bitwiseCRC32(const std::uint8_t* data, std::size_t length, std::uint32_t crc = 0) {
+    crc = ~crc;
+    for (std::size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+
+    return ~crc;
+}
+
+// Kernels work on the CRC register as it is, without the inversions crc32 does around them
+struct Kernel {
+    const char* name;
+    Hips::Detail::Crc32Kernel function;
+};
+
+static_assert(Hips::crc32Combine(0xCBF43926, 0, 0) == 0xCBF43926);
+
+int main() {
+    std::vector<Kernel> kernels = {{"tables", Hips::Detail::crc32Table}};
+#if defined(HIPS_X86)
+    if (Hips::Detail::cpuFeatures().pclmul) {
+        kernels.push_back({"PCLMUL", Hips::Detail::crc32Accelerated});
+    }
+#elif defined(HIPS_ARM_PMULL)
+    if (Hips::Detail::cpuFeatures().pmull) {
+        kernels.push_back({"PMULL", Hips::Detail::crc32Accelerated});
+    }
+#endif
+
+    std::mt19937 random(1);
+    Bytes buffer(1 << 20);
+    for (auto& byte : buffer) {
+        byte = std::uint8_t(random());
+    }
+
+    int failures = 0;
+    const auto report = [&](const char* name, std::size_t offset, std::size_t length, std::uint32_t got, std::uint32_t expected) {
+        if (got != expected && failures++ < 20) {
+            std::printf("%s: %zu bytes at %zu gave %08x instead of %08x\n", name, length, offset, unsigned(got), unsigned(expected));
+        }
+    };
+
+    const std::uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    report("crc32", 0, sizeof(check), Hips::crc32(check, sizeof(check)), 0xCBF43926);
+
+    // Mostly short lengths, where the kernels switch between their main loops and their tails, and some long ones
+    for (int i = 0; i < 20000; i++) {
+        const std::size_t length = random() % 64 == 0 ? random() % (buffer.size() / 4) : random() % 1024;
+        const std::size_t offset = random() % (buffer.size() - length + 1);
+        const std::uint32_t seed = random() % 4 == 0 ? 0 : std::uint32_t(random());
+        const std::uint8_t* data = buffer.data() + offset;
+        const std::uint32_t expected = bitwiseCRC32(data, length, seed);
+
+        for (const Kernel& kernel : kernels) {
+            report(kernel.name, offset, length, ~kernel.function(data, length, ~seed), expected);
+        }
+
+        report("crc32", offset, length, Hips::crc32(data, length, seed), expected);
+
+        // Splitting the data anywhere and combining the CRC32s of the pieces gives the CRC32 of the whole
+        const std::size_t split = random() % (length + 1);
+        const std::uint32_t first = bitwiseCRC32(data, split, seed);
+        report("crc32Combine", offset, length, Hips::crc32Combine(first, bitwiseCRC32(data + split, length - split), length - split), expected);
+    }
+
+    Hips::ThreadPool pool(4);
+    for (std::size_t length : {std::size_t(0), std::size_t(1), std::size_t(100000), buffer.size() - 3}) {
+        report("crc32 on a pool", 3, length, Hips::crc32(pool, buffer.data() + 3, length, 0x1234), bitwiseCRC32(buffer.data() + 3, length, 0x1234));
+    }
+
+    std::printf("%zu kernels, %d failures\n", kernels.size(), failures);
+    return failures == 0 ? 0 : 1;
+}
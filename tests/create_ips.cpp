@@ -0,0 +1,84 @@
+// Round trips createIPS through patchIPS and patchIPSInPlace, which size their output differently when a patch has no size
+// footer: patchIPS ends the file at the last record, while patchIPSInPlace keeps the size of the input
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+using Bytes = std::vector<std::uint8_t>;
+
+static int failures = 0;
+
+static void check(const char* name, const Bytes& source, const Bytes& target) {
+    auto [patch, result] = Hips::createIPS(source.data(), source.size(), target.data(), target.size());
+    if (result != Hips::Result::Success) {
+        std::printf("%s: createIPS failed\n", name);
+        failures++;
+        return;
+    }
+
+    auto [patched, patchResult] = Hips::patchIPS(source.data(), source.size(), patch.data(), patch.size());
+    if (patchResult != Hips::Result::Success || patched != target) {
+        std::printf("%s: patchIPS gave %zu bytes instead of %zu\n", name, patched.size(), target.size());
+        failures++;
+    }
+
+    Bytes inPlace = source;
+    if (Hips::patchIPSInPlace(inPlace, patch.data(), patch.size()) != Hips::Result::Success || inPlace != target) {
+        std::printf("%s: patchIPSInPlace gave %zu bytes instead of %zu\n", name, inPlace.size(), target.size());
+        failures++;
+    }
+}
+
+static Bytes randomBytes(std::mt19937& random, std::size_t size) {
+    Bytes bytes(size);
+    for (auto& byte : bytes) {
+        byte = std::uint8_t(random());
+    }
+
+    return bytes;
+}
+
+int main() {
+    std::mt19937 random(1);
+
+    // The last record reaches the end of a target that's shorter than the source
+    Bytes source = randomBytes(random, 1000);
+    Bytes target(source.begin(), source.begin() + 500);
+    target[499] ^= 1;
+    check("shrink, change at the end", source, target);
+
+    target[499] ^= 1;
+    check("shrink, no changes", source, target);
+    check("shrink to nothing", source, {});
+    check("same size", source, source);
+
+    target = source;
+    target.resize(1500);
+    check("grow with zeros", source, target);
+
+    for (int i = 0; i < 500; i++) {
+        source = randomBytes(random, random() % 4096);
+        target = source;
+        target.resize(random() % 4096);
+
+        for (int changes = random() % 16; changes > 0 && !target.empty(); changes--) {
+            target[random() % target.size()] = std::uint8_t(random());
+        }
+
+        check("random", source, target);
+    }
+
+    // The footer can't hold the size of targets past 16 MiB, so those can't be made shorter than their source
+    source.assign(0x1000000 + 100, 0);
+    target.assign(0x1000000 + 50, 0);
+    if (Hips::createIPS(source.data(), source.size(), target.data(), target.size()).second != Hips::Result::SizeMismatch) {
+        std::printf("shrinking a target past 16 MiB didn't give SizeMismatch\n");
+        failures++;
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
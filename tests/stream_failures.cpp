@@ -0,0 +1,84 @@
+// Makes every read of the patch fail in turn, for every format of the streaming API, and checks that patching stops with
+// IOError instead of carrying on with data it never got
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+using Bytes = std::vector<std::uint8_t>;
+
+// Source whose read number "failAt" (counting from 1) fails, and every read after it
+class FailingSource : public Hips::Stream::MemorySource {
+    std::size_t reads = 0;
+    std::size_t failAt;
+
+public:
+    FailingSource(const Bytes& data, std::size_t failAt) : MemorySource(data.data(), data.size()), failAt(failAt) {}
+
+    bool read(std::uint64_t offset, std::uint8_t* dest, std::size_t length) override {
+        if (++reads >= failAt) {
+            return false;
+        }
+
+        return MemorySource::read(offset, dest, length);
+    }
+
+    std::size_t readCount() const { return reads; }
+};
+
+int main() {
+    std::mt19937 random(1);
+    Bytes source(4096);
+    for (auto& byte : source) {
+        byte = std::uint8_t(random());
+    }
+
+    Bytes target = source;
+    for (int i = 0; i < 200; i++) {
+        target[random() % target.size()] = std::uint8_t(random());
+    }
+
+    const struct {
+        const char* name;
+        Hips::PatchType type;
+        Bytes patch;
+    } cases[] = {
+        {"IPS", Hips::PatchType::IPS, Hips::createIPS(source.data(), source.size(), target.data(), target.size()).first},
+        {"UPS", Hips::PatchType::UPS, Hips::createUPS(source.data(), source.size(), target.data(), target.size())},
+        {"BPS", Hips::PatchType::BPS, Hips::createBPS(source.data(), source.size(), target.data(), target.size())},
+    };
+
+    Hips::Stream::Options options;
+    options.chunkSize = 64;  // Lots of small reads
+    int failures = 0;
+
+    for (const auto& c : cases) {
+        // Count the reads a successful run takes, then fail each of them
+        Hips::Stream::MemorySource input(source.data(), source.size());
+        FailingSource patch(c.patch, ~std::size_t(0));
+        Bytes output;
+        Hips::Stream::VectorSink sink(output);
+
+        if (Hips::Stream::patch(input, patch, sink, c.type, options) != Hips::Result::Success || output != target) {
+            std::printf("%s: patching without failures didn't give the target\n", c.name);
+            failures++;
+            continue;
+        }
+
+        for (std::size_t failAt = 1; failAt <= patch.readCount(); failAt++) {
+            FailingSource failing(c.patch, failAt);
+            output.clear();
+
+            const Hips::Result result = Hips::Stream::patch(input, failing, sink, c.type, options);
+            if (result != Hips::Result::IOError) {
+                std::printf("%s: failing read %zu of %zu gave result %d\n", c.name, failAt, patch.readCount(), int(result));
+                failures++;
+            }
+        }
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
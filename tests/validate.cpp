@@ -0,0 +1,169 @@
+// Applies random and corrupted patches with every read policy. Anything the Validated pre-pass accepts has to come out of
+// ReadPolicy::Trusted the same as out of ReadPolicy::Checked, and anything Hips::validate accepts has to apply with the
+// output size it reports, unless the output checksum (which only applying can check) is wrong
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+using Bytes = std::vector<std::uint8_t>;
+
+static int failures = 0;
+
+static Bytes randomBytes(std::mt19937& random, std::size_t size) {
+    Bytes bytes(size);
+    for (auto& byte : bytes) {
+        byte = std::uint8_t(random() % 4 == 0 ? random() : 0);
+    }
+
+    return bytes;
+}
+
+// Random records, some of them RLE, with a size footer now and then and sometimes without the EOF
+static Bytes randomIPS(std::mt19937& random, std::size_t inputSize) {
+    Bytes patch = {'P', 'A', 'T', 'C', 'H'};
+    const int records = random() % 40;
+
+    for (int i = 0; i < records; i++) {
+        std::size_t offset = random() % (inputSize + 200);
+        if (offset == 0x454F46) {
+            offset++;
+        }
+
+        patch.insert(patch.end(), {std::uint8_t(offset >> 16), std::uint8_t(offset >> 8), std::uint8_t(offset)});
+        const std::uint16_t length = std::uint16_t(1 + random() % 300);
+        if (random() % 3 == 0) {
+            patch.insert(patch.end(), {0, 0, std::uint8_t(length >> 8), std::uint8_t(length), std::uint8_t(random())});
+        } else {
+            patch.insert(patch.end(), {std::uint8_t(length >> 8), std::uint8_t(length)});
+            for (int k = 0; k < length; k++) {
+                patch.push_back(std::uint8_t(random()));
+            }
+        }
+    }
+
+    if (random() % 8 != 0) {
+        patch.insert(patch.end(), {'E', 'O', 'F'});
+        if (random() % 3 == 0) {
+            const std::size_t size = random() % (inputSize + 300);
+            patch.insert(patch.end(), {std::uint8_t(size >> 16), std::uint8_t(size >> 8), std::uint8_t(size)});
+        }
+    }
+
+    return patch;
+}
+
+static Bytes makePatch(std::mt19937& random, Hips::PatchType type, const Bytes& source) {
+    if (type == Hips::PatchType::IPS) {
+        return randomIPS(random, source.size());
+    }
+
+    Bytes target = source;
+    for (int i = 0; i < 8 && !target.empty(); i++) {
+        target[random() % target.size()] ^= std::uint8_t(1 + random() % 255);
+    }
+
+    target.resize(random() % 4000);
+    return type == Hips::PatchType::UPS ? Hips::createUPS(source.data(), source.size(), target.data(), target.size())
+                                        : Hips::createBPS(source.data(), source.size(), target.data(), target.size());
+}
+
+// Overwrites a few bytes and sometimes cuts the patch short, usually fixing up the patch CRC so the damage gets past it
+static void corrupt(std::mt19937& random, Hips::PatchType type, Bytes& patch) {
+    const int changes = 1 + random() % 4;
+    for (int i = 0; i < changes && !patch.empty(); i++) {
+        patch[random() % patch.size()] = std::uint8_t(random());
+    }
+
+    if (random() % 3 == 0 && !patch.empty()) {
+        patch.resize(random() % patch.size());
+    }
+
+    if (type != Hips::PatchType::IPS && patch.size() >= 16 && random() % 4 != 0) {
+        const std::uint32_t crc = Hips::crc32(patch.data(), patch.size() - 4);
+        for (int i = 0; i < 4; i++) {
+            patch[patch.size() - 4 + i] = std::uint8_t(crc >> (8 * i));
+        }
+    }
+}
+
+static Hips::ValidationReport prePass(const Bytes& patch, Hips::PatchType type) {
+    switch (type) {
+        case Hips::PatchType::IPS: return Hips::IPS::validate(patch.data(), patch.size());
+        case Hips::PatchType::UPS: return Hips::UPS::validate(patch.data(), patch.size());
+        default: return Hips::BPS::validate(patch.data(), patch.size());
+    }
+}
+
+int main() {
+    std::mt19937 random(23);
+    int validated = 0;
+
+    for (int i = 0; i < 20000; i++) {
+        const auto type = Hips::PatchType(random() % 3);
+        const Bytes source = randomBytes(random, random() % 3000);
+        Bytes patch = makePatch(random, type, source);
+        const bool corrupted = random() % 2 != 0;
+        if (corrupted) {
+            corrupt(random, type, patch);
+        }
+
+        // Corrupted sizes can ask for far more output than is worth allocating
+        const auto [outputSize, sizeResult] = Hips::queryOutputSize(patch.data(), patch.size(), type);
+        if (sizeResult == Hips::Result::Success && outputSize > (1 << 22)) {
+            continue;
+        }
+
+        const auto [checked, checkedResult] = Hips::patch(source.data(), source.size(), patch.data(), patch.size(), type);
+        const auto [validatedOutput, validatedResult] =
+            Hips::patch<Hips::ReadPolicy::Validated>(source.data(), source.size(), patch.data(), patch.size(), type);
+
+        // The Validated pre-pass only rejects patches the Checked patchers reject too
+        if (validatedResult != checkedResult && validatedResult != Hips::Result::InvalidPatch) {
+            std::printf("case %d: Validated gave %u, Checked %u\n", i, unsigned(validatedResult), unsigned(checkedResult));
+            failures++;
+        } else if (validatedResult == Hips::Result::InvalidPatch && checkedResult == Hips::Result::Success) {
+            std::printf("case %d: Validated rejected a patch Checked applies\n", i);
+            failures++;
+        }
+
+        const bool passed = prePass(patch, type).result == Hips::Result::Success;
+        if (passed) {
+            validated++;
+            const auto [trusted, trustedResult] =
+                Hips::patch<Hips::ReadPolicy::Trusted>(source.data(), source.size(), patch.data(), patch.size(), type);
+            if (trustedResult != checkedResult || (checkedResult == Hips::Result::Success && trusted != checked)) {
+                std::printf("case %d: Trusted gave %u, Checked %u\n", i, unsigned(trustedResult), unsigned(checkedResult));
+                failures++;
+            }
+        }
+
+        const Hips::ValidationReport report = Hips::validate(patch.data(), patch.size(), type, source.size());
+        if (report.result == Hips::Result::Success) {
+            if (!passed) {
+                std::printf("case %d: validate accepted a patch the Validated pre-pass rejects\n", i);
+                failures++;
+            } else if (checkedResult == Hips::Result::Success ? checked.size() != report.outputSize
+                                                               : checkedResult != Hips::Result::ChecksumMismatch) {
+                std::printf("case %d: validated patch gave %u and %zu bytes\n", i, unsigned(checkedResult), checked.size());
+                failures++;
+            }
+        } else if (!corrupted && type != Hips::PatchType::IPS) {
+            std::printf("case %d: validate rejected a clean patch with error %u\n", i, unsigned(report.error));
+            failures++;
+        }
+
+        if (failures > 10) {
+            break;
+        }
+    }
+
+    if (validated < 1000) {
+        std::printf("only %d patches got past the Validated pre-pass\n", validated);
+        failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+// Checks every XOR kernel built for this CPU, and xorRun on top of whichever one it picks, against a byte at a time loop
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "../include/hips.hpp"
+
+using Bytes = std::vector<std::uint8_t>;
+
+struct Kernel {
+    const char* name;
+    Hips::Detail::XorKernel function;
+    std::size_t blockSize;
+};
+
+// Patch bytes are 0 (the end of a run) with a probability of 1 in "zeroOdds", so some runs are long and some short
+static void fill(std::mt19937& random, Bytes& patch, unsigned zeroOdds) {
+    for (auto& byte : patch) {
+        byte = random() % zeroOdds == 0 ? 0 : std::uint8_t(1 + random() % 255);
+    }
+}
+
+int main() {
+    std::vector<Kernel> kernels = {{"scalar", Hips::Detail::xorBlocksScalar, 8}};
+#if defined(HIPS_SSE2)
+    kernels.push_back({"SSE2", Hips::Detail::xorBlocksSSE2, 16});
+#endif
+#if defined(HIPS_X86)
+    if (Hips::Detail::cpuFeatures().avx2) {
+        kernels.push_back({"AVX2", Hips::Detail::xorBlocksAVX2, 32});
+    }
+#endif
+
+    std::mt19937 random(1);
+    int failures = 0;
+    constexpr int cases = 300000;
+
+    // A kernel goes through whole blocks, and stops at the first one with a 0 in the patch or once less than a block is left
+    for (const Kernel& kernel : kernels) {
+        for (int i = 0; i < cases && failures < 20; i++) {
+            const std::size_t length = random() % 300;
+            Bytes source(length), patch(length), dest(length + 1, 0xAA);
+            for (auto& byte : source) {
+                byte = std::uint8_t(random());
+            }
+
+            fill(random, patch, 1 + random() % 400);
+            const std::size_t count = kernel.function(dest.data(), source.data(), patch.data(), length);
+
+            std::size_t expected = 0;
+            while (expected + kernel.blockSize <= length &&
+                   std::find(patch.begin() + expected, patch.begin() + expected + kernel.blockSize, 0) == patch.begin() + expected + kernel.blockSize) {
+                expected += kernel.blockSize;
+            }
+
+            bool correct = count == expected;
+            for (std::size_t j = 0; j < dest.size() && correct; j++) {
+                correct = dest[j] == (j < count ? std::uint8_t(source[j] ^ patch[j]) : 0xAA);
+            }
+
+            if (!correct) {
+                std::printf("%s: wrong result for %zu bytes (processed %zu, expected %zu)\n", kernel.name, length, count, expected);
+                failures++;
+            }
+        }
+    }
+
+    // xorRun with the source and the patch ending anywhere, including before the run starts
+    for (int i = 0; i < cases && failures < 20; i++) {
+        const std::size_t sourceSize = random() % 300, patchSize = random() % 300;
+        Bytes source(sourceSize), patch(patchSize);
+        for (auto& byte : source) {
+            byte = std::uint8_t(random());
+        }
+
+        fill(random, patch, 1 + random() % 400);
+        const std::size_t length = random() % 320;
+        std::size_t sourceOffset = random() % 320, patchOffset = random() % 320;
+
+        Bytes expected(length, 0xAA);
+        std::size_t expectedCount = 0;
+        while (expectedCount < length) {
+            const std::size_t s = sourceOffset + expectedCount, p = patchOffset + expectedCount;
+            const std::uint8_t patchValue = p < patchSize ? patch[p] : 0;
+            expected[expectedCount++] = (s < sourceSize ? source[s] : 0) ^ patchValue;
+
+            if (patchValue == 0) {
+                break;
+            }
+        }
+
+        Bytes dest(length, 0xAA);
+        const std::size_t startSource = sourceOffset, startPatch = patchOffset;
+        const std::size_t count =
+            Hips::Detail::xorRun(dest.data(), length, source.data(), sourceOffset, sourceSize, patch.data(), patchOffset, patchSize);
+
+        if (count != expectedCount || dest != expected || sourceOffset != startSource + count || patchOffset != startPatch + count) {
+            std::printf("xorRun: wrong result for a run of up to %zu bytes (got %zu, expected %zu)\n", length, count, expectedCount);
+            failures++;
+        }
+    }
+
+    std::printf("%zu kernels, %d failures\n", kernels.size(), failures);
+    return failures == 0 ? 0 : 1;
+}